@@ -16,13 +16,38 @@
 // The program ensures there are no memory leaks. 
 // This program assumes there will always be at least one train in the program,
 // although there can exist 0 carriages. 
-// Further limitations are that happiness scores and happiness optimisation
-// were not implemented into the program.
+// Happiness depends on the type of carriage a passenger is in and how 
+// crowded it is, and passengers can be rearranged to make them happiest.
+//
+// Command line options:
+//      --batch [file]  read all of the commands at once, from file or stdin
+//      --quiet         leave out confirmations and prompts
+//      --bench [n] [m] time each command on n trains of m carriages
+//      --generate seed count
+//                      print a reproducible script of count valid commands
+//      --journal file  record every change in file, and recover the
+//                      network from it on startup
+//      --desks file... run the commands in each file at its own desk, 
+//                      all at once
+//      --shards file...
+//                      run the commands in each file on its own networks, 
+//                      all at once
+//      --stats file    write what every command cost to file as JSON at exit
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////      Contants       ////////////////////////////////
@@ -30,12 +55,55 @@
 
 // Constants
 #define ID_SIZE 6
+#define INDEX_MIN_SIZE 16
+#define CARRIAGE_SLAB_SIZE 1024
+#define TRAIN_SLAB_SIZE 64
+#define CACHE_LINE 64
+#define INPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 1048576
+#define MAX_LINE 256
+#define PATH_SIZE 256
+#define TEMP_SUFFIX ".tmp"
+#define SNAPSHOT_MAGIC "CSNP"
+#define SNAPSHOT_VERSION 1
+#define SUMMARY_SIZE 128
+#define PARALLEL_PRINT_TRAINS 4096
+#define PRINT_WORKERS 8
+#define PRINT_WORKER_TRAINS 1024
+#define JOURNAL_FLAG "--journal"
+#define DESKS_FLAG "--desks"
+#define SHARDS_FLAG "--shards"
+#define STATS_FLAG "--stats"
+#define STATS_CODES "?apilsdeuTcmhHN><gPLrRMSOwonjxz"
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS 320
+#define JOURNAL_MAGIC "CJNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_BUFFER_SIZE 65536
+#define BATCH_FLAG "--batch"
+#define QUIET_FLAG "--quiet"
+#define BENCH_FLAG "--bench"
+#define BENCH_TRAINS 16
+#define BENCH_CARRIAGES 10000
+#define BENCH_OPS 10000
+#define BENCH_SEED 2463534242u
+#define GENERATE_FLAG "--generate"
+#define GENERATE_POLL_PERIOD 1000
+#define GENERATE_SHUNT_PERIOD 250
+#define GENERATE_MAX_TRAINS 32
+#define GENERATE_MAX_SPLITS 3
+#define ID_DIGITS 36
+#define ID_SPACE 60466176
+#define ID_SCRAMBLE 2654435761u
 #define HELP '?'
 #define ADD 'a'
 #define PRINT 'p'
 #define INSERT 'i'
 #define SEAT 's'
 #define DISEMBARK 'd'
+#define BULK_SEAT 'e'
+#define BULK_DISEMBARK 'u'
 #define TOTAL 'T'
 #define COUNT 'c'
 #define MOVE 'm'
@@ -48,6 +116,27 @@
 #define REMOVE_TRAIN 'R'
 #define MERGE 'M'
 #define SPLIT 'S'
+#define SELECT 'g'
+#define PRINT_RANGE 'l'
+#define PRINT_TRAINS 'L'
+#define SAVE 'w'
+#define LOAD 'o'
+#define STATS 'z'
+#define HAPPINESS 'h'
+#define AVERAGE_HAPPINESS 'H'
+#define OPTIMISE 'O'
+#define NEW_NETWORK 'n'
+#define SWITCH_NETWORK 'j'
+#define DROP_NETWORK 'x'
+#define DIRECTORY_MIN_SIZE 8
+#define HAPPINESS_SCALE 1000000
+#define CROWDING_PENALTY 40
+#define PASSENGER_HAPPINESS 80
+#define BUFFET_HAPPINESS 90
+#define RESTROOM_HAPPINESS 70
+#define FIRST_CLASS_HAPPINESS 100
+#define OPTIMISE_STEPS 64
+#define NETWORK_LIST_MIN_SIZE 4
 
 // Enums
 enum carriage_type {INVALID_TYPE, PASSENGER, BUFFET, RESTROOM, FIRST_CLASS};
@@ -59,27 +148,429 @@ enum condition {INVALID, VALID};
 ////////////////////////////////////////////////////////////////////////////////
 
 // A Train Carriage
+// Kept to 64 bytes, so that with the slabs aligned to CACHE_LINE each 
+// carriage visited in the tree costs exactly one cache line.
 struct carriage {
     // carriage id in the form #"N1002", unique, null terminated
     char carriage_id[ID_SIZE];
-    //  Type of the carriage
-    enum carriage_type type;
+    // Type of the carriage, an enum carriage_type kept to one byte so the
+    // happiness total still fits in the cache line
+    unsigned char type;
     // Maximum number of passengers 
     int capacity;
     // Current number of passengers
     int occupancy;
 
-    struct carriage *next;
+    // The carriages of a train are stored in a balanced tree (a treap), 
+    // ordered by their position in the train. 
+    struct carriage *left;
+    struct carriage *right;
+    struct carriage *parent;
+    // Priority of the carriage in the tree, never more than its parent's.
+    unsigned int priority;
+    // Number of carriages in the subtree rooted at this carriage
+    int size;
+    // Total capacity of the carriages in the subtree
+    int total_capacity;
+    // Total occupancy of the carriages in the subtree
+    int total_occupancy;
+    // Total happiness of the passengers in the subtree, in HAPPINESS_SCALE
+    // parts of a point, see happiness_points
+    long long total_happiness;
+};
+_Static_assert(sizeof(struct carriage) == CACHE_LINE, 
+               "a carriage must fill exactly one cache line");
+
+// Hash table of the carriages in a train, keyed on the carriage ID.
+// Uses open addressing with linear probing.
+struct id_index {
+    // Table of carriage pointers, NULL marks an empty slot.
+    struct carriage **slots;
+    // Number of slots in the table, always 0 or a power of two.
+    int size;
+    // Number of carriages stored in the table.
+    int count;
 };
 
 // A Train
 struct train {
-    // The head pointer to a linked list of carriages.
+    // The root of the tree of carriages.
     struct carriage *carriages;
-    // A pointer to the next train in the linked list of trains.
-    struct train *next;
-    // A pointer to the previous train in the linked list of trains.
-    struct train *previous;
+    // Index of the carriages in the train by their carriage ID.
+    struct id_index index;
+    // Pool the train and its carriages are allocated from.
+    struct pool *pool;
+    // Directory the train is listed in.
+    struct directory *directory;
+    // Position of the train in the directory, which is its train number.
+    int number;
+    // The next free train, while the train is in the pool's free list.
+    struct train *next_free;
+    // Held by a desk while it works on the train's carriages.
+    pthread_mutex_t lock;
+    // Number of desks with the train selected
+    int num_desks;
+};
+
+// The list of trains, in order, so any train can be found by its number.
+struct directory {
+    struct train **trains;
+    // Number of trains in the list
+    int count;
+    // Number of trains there is room for
+    int size;
+    // Shared by desks working on their own trains, held by one desk alone 
+    // to change the list of trains.
+    pthread_rwlock_t lock;
+    // Number of desks working on the trains
+    int num_desks;
+};
+
+// A rail network, which has its own pool so it is kept apart from others
+struct network {
+    // Position of the network in its list, which is its network number
+    int number;
+    // Pool the network's trains and carriages are allocated from
+    struct pool *pool;
+    // The network's trains, in order
+    struct directory *directory;
+    // The train commands are carried out on
+    struct train *selected;
+};
+
+// Every network hosted by one stream of commands, in order
+struct network_list {
+    struct network **networks;
+    // Number of networks in the list
+    int count;
+    // Number of networks there is room for
+    int size;
+    // The network commands are carried out on
+    struct network *current;
+};
+
+// A block of carriages allocated at once, aligned to CACHE_LINE
+struct carriage_slab {
+    struct carriage carriages[CARRIAGE_SLAB_SIZE];
+    struct carriage_slab *next;
+};
+
+// A block of trains allocated at once
+struct train_slab {
+    struct train trains[TRAIN_SLAB_SIZE];
+    struct train_slab *next;
+};
+
+// Allocator for carriage and train nodes. Nodes are handed out from slabs
+// and freed nodes are kept for reuse on intrusive free lists.
+struct pool {
+    // Stack of freed carriage trees, linked through the roots' parent.
+    // A tree is only broken up as its carriages are reused, so a whole
+    // train can be freed at once.
+    struct carriage *free_carriages;
+    // List of freed trains, linked through their next pointer.
+    struct train *free_trains;
+    // Slabs of carriages, the newest first.
+    struct carriage_slab *carriage_slabs;
+    // Number of carriages handed out from the newest carriage slab.
+    int carriages_used;
+    // Slabs of trains, the newest first.
+    struct train_slab *train_slabs;
+    // Number of trains handed out from the newest train slab.
+    int trains_used;
+    // VALID if desks on other threads share the pool
+    int is_shared;
+    // Held while taking or handing back nodes of a shared pool
+    pthread_mutex_t lock;
+};
+
+// A command read from the input, along with its arguments
+struct command {
+    // The command letter
+    char code;
+    // Number argument: the position for 'i', the passengers for 's', 'd' 
+    // and 'm', the number of splits for 'S', the number of loads for 'e'
+    // and 'u', the train number for 'g', 
+    // the first carriage or train to print for 'l' and 'L', and the 
+    // network number for 'j'
+    int n;
+    // Second number argument: the position to stop printing at for 'l',
+    // and the number of trains to print for 'L'
+    int other_n;
+    // Carriage ID argument: the new carriage for 'a' and 'i', the carriage 
+    // for 's', 'd', 'r' and 'h', the start for 'c' and the source for 'm'
+    char id[ID_SIZE];
+    // Second carriage ID argument: the end for 'c', the destination for 'm'
+    char other_id[ID_SIZE];
+    // Type of the new carriage for 'a' and 'i'
+    enum carriage_type type;
+    // Capacity of the new carriage for 'a' and 'i'
+    int capacity;
+    // The `n` carriage IDs to split at for 'S', or to load for 'e' and 'u'
+    char (*ids)[ID_SIZE];
+    // Passengers to seat or remove at each of the IDs for 'e' and 'u'
+    int *loads;
+    // Number of IDs there is room for in ids and loads
+    int ids_size;
+    // File to save the network to for 'w', or load it from for 'o'
+    char path[PATH_SIZE];
+    // The snapshot an 'o' record of the journal holds, in the journal
+    char *snapshot;
+    // Number of bytes in the snapshot
+    long snapshot_length;
+};
+
+// Buffered source of the commands
+struct input {
+    // File descriptor the input is read from
+    int fd;
+    // Input read so far
+    char *buffer;
+    // Number of bytes in the buffer
+    long length;
+    // Position of the next byte to read from the buffer
+    long position;
+    // VALID if all of the input was read into the buffer at once
+    int is_batch;
+    // VALID if the buffer is a memory mapped file
+    int is_mapped;
+};
+
+// Buffered destination of everything the program prints
+struct output {
+    // File descriptor the output is written to
+    int fd;
+    // Output waiting to be written
+    char *buffer;
+    // Number of bytes in the buffer
+    int length;
+    // VALID if confirmations and prompts should not be printed
+    int is_quiet;
+    // VALID if nothing should be printed at all
+    int is_muted;
+};
+
+// Start of a journal file
+struct journal_header {
+    // JOURNAL_MAGIC, without its '\0'
+    char magic[4];
+    // JOURNAL_VERSION when the file was started
+    unsigned int version;
+};
+
+// The journal every change to the network is recorded in, so the network 
+// can be recovered by replaying it. Records are written in groups.
+struct journal {
+    // VALID if changes are being recorded
+    int is_open;
+    // The journal file, which a checkpoint replaces
+    char *path;
+    // File descriptor of the journal file
+    int fd;
+    // Records waiting to be written
+    char *buffer;
+    // Number of bytes in the buffer
+    int length;
+    // Number of networks. The journal only starts again from a snapshot 
+    // when the snapshot holds the only network.
+    int num_networks;
+};
+
+// A run of trains whose summaries are formatted by one print worker
+struct summary_job {
+    // The selected train, which is marked in its summary
+    struct train *selected;
+    // Number of the first train in the run
+    int first;
+    // Number of the train after the last one in the run
+    int end;
+    // The formatted summaries, SUMMARY_SIZE bytes per train at most
+    char *text;
+    // Number of bytes in text
+    int length;
+};
+
+// The print workers, started by the first long print and kept until the 
+// program ends. Each print hands its runs of trains to them and waits 
+// until every run is done.
+struct print_pool {
+    // Held while runs are taken or handed out
+    pthread_mutex_t lock;
+    // Signalled when there are runs to take, or the workers should stop
+    pthread_cond_t has_jobs;
+    // Signalled when the last run of a print is done
+    pthread_cond_t is_done;
+    // Held by the print using the workers, as desks and shards print at once
+    pthread_mutex_t use_lock;
+    // The worker threads
+    pthread_t threads[PRINT_WORKERS];
+    // Number of worker threads running
+    int num_threads;
+    // Whether the workers have been started
+    int is_started;
+    // Whether the workers should stop
+    int is_stopping;
+    // The runs of the print using the workers
+    struct summary_job *jobs;
+    // Number of runs
+    int num_jobs;
+    // Number of the next run to be taken
+    int next_job;
+    // Number of runs done
+    int num_done;
+};
+
+// A shard, carrying out its own stream of commands on its own networks, 
+// on its own thread
+struct shard {
+    // Number of the shard
+    int number;
+    // Commands given to the shard
+    struct input input;
+    // VALID if confirmations and prompts should not be printed
+    int is_quiet;
+    // Thread the shard runs on
+    pthread_t thread;
+    // VALID if the shard got its own thread
+    int is_started;
+};
+
+// A control desk, carrying out its own stream of commands on its own thread
+struct desk {
+    // Number of the desk, which is also the train it starts at
+    int number;
+    // Commands given at the desk
+    struct input input;
+    // The train the desk is working on
+    struct train *selected;
+    // VALID if confirmations and prompts should not be printed
+    int is_quiet;
+    // Thread the desk runs on
+    pthread_t thread;
+    // VALID if the desk got its own thread
+    int is_started;
+};
+
+// Options given to the program on the command line
+struct options {
+    // VALID if all of the commands should be read at once
+    int is_batch;
+    // File to read the commands from in batch mode, NULL for stdin
+    char *batch_path;
+    // VALID if confirmations and prompts should not be printed
+    int is_quiet;
+    // VALID if the benchmarks should be run instead of reading commands
+    int is_bench;
+    // Number of trains in the benchmark network
+    int bench_trains;
+    // Number of carriages in each train of the benchmark network
+    int bench_carriages;
+    // VALID if a command script should be generated instead
+    int is_generate;
+    // Seed of the generated script
+    unsigned int generate_seed;
+    // Number of commands in the generated script
+    int generate_count;
+    // File to record changes in and recover them from, or NULL
+    char *journal_path;
+    // Number of control desks to run at once, 0 for none
+    int num_desks;
+    // File of commands for each control desk
+    char **desk_paths;
+    // Number of shards to run at once, 0 for none
+    int num_shards;
+    // File of commands for each shard
+    char **shard_paths;
+    // File to write the statistics to at exit, or NULL
+    char *stats_path;
+};
+
+// A carriage as the script generator expects it to be in the simulator
+struct generated_carriage {
+    // Number the carriage ID was made from with number_to_id
+    int number;
+    int capacity;
+    int occupancy;
+};
+
+// A train as the script generator expects it to be in the simulator
+struct generated_train {
+    struct generated_carriage *carriages;
+    // Number of carriages in the train
+    int length;
+    // Number of carriages there is room for
+    int size;
+};
+
+// The network as the script generator expects it to be in the simulator,
+// so the generated commands refer to carriages that exist.
+struct generator {
+    // Trains in the order of the simulator's train list
+    struct generated_train *trains;
+    int num_trains;
+    // Number of trains there is room for
+    int trains_size;
+    // Position of the selected train in the list
+    int selected;
+    // Number the next new carriage ID is made from
+    int next_number;
+    // Turns between the split and merge shunting commands
+    int is_next_split;
+    unsigned int seed;
+};
+
+// Counts of the calls made to the memory allocator
+struct memory_stats {
+    // Calls that allocated memory, including reallocations
+    atomic_long allocations;
+    // Calls that freed memory
+    atomic_long frees;
+};
+
+// Counters and latencies of one command letter
+struct command_stats {
+    // Number of times the command was carried out
+    long count;
+    // Total time the command took
+    long total_ns;
+    // Longest time the command took
+    long max_ns;
+    // Number of times the command took each range of latencies, 
+    // see latency_bucket
+    unsigned int histogram[HISTOGRAM_BUCKETS];
+};
+
+// What the program has spent its time on
+struct stats {
+    // Each command letter in STATS_CODES, then every other letter together
+    struct command_stats commands[sizeof(STATS_CODES)];
+    // Slots of carriage indexes looked at while finding IDs
+    long index_probes;
+    // Carriages visited while walking up or down carriage trees
+    long tree_steps;
+};
+
+// Start of a snapshot file. Numbers are saved in the byte order of the 
+// machine that saved them.
+struct snapshot_header {
+    // SNAPSHOT_MAGIC, without its '\0'
+    char magic[4];
+    // SNAPSHOT_VERSION when the file was saved
+    unsigned int version;
+    // Number of trains saved
+    unsigned int num_trains;
+    // Number of the selected train
+    unsigned int selected;
+};
+
+// A carriage as it is saved in a snapshot. After the header, each train is
+// saved as the number of its carriages followed by its carriages in order.
+struct carriage_record {
+    char carriage_id[ID_SIZE];
+    unsigned char type;
+    unsigned char padding;
+    int capacity;
+    int occupancy;
 };
 
 struct space {
@@ -88,9 +579,32 @@ struct space {
     int occupied;
 };
 
-struct ends {
-    char start[ID_SIZE];
-    char end[ID_SIZE];
+// Everything is printed through this one output, so that it can be 
+// written out in large blocks. Each desk's thread has its own.
+static _Thread_local struct output sink;
+
+// Held while writing to the output file, so desks write whole blocks.
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every change to the network is recorded here when journaling is on.
+static struct journal journal;
+
+// Every allocation and free goes through wrappers that count them here.
+static struct memory_stats memory;
+
+// Every command and lookup is counted here by the thread that does it.
+static _Thread_local struct stats stats;
+
+// Each thread's statistics are added to these when it is done.
+static struct stats all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Long prints are split between these workers.
+static struct print_pool print_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .has_jobs = PTHREAD_COND_INITIALIZER,
+    .is_done = PTHREAD_COND_INITIALIZER,
+    .use_lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -98,8 +612,8 @@ struct ends {
 ////////////////////////////////////////////////////////////////////////////////
 void print_usage(void);
 void print_carriage(struct carriage *carriage);
-void scan_id(char id_buffer[ID_SIZE]);
-enum carriage_type scan_type(void);
+void scan_id(struct input *input, char id_buffer[ID_SIZE]);
+enum carriage_type scan_type(struct input *input);
 void print_train_summary(
     int is_selected, 
     int n, 
@@ -107,85 +621,312 @@ void print_train_summary(
     int occupancy,
     int num_carriages
 );
+int format_train_summary(
+    char text[SUMMARY_SIZE],
+    int is_selected, 
+    int n, 
+    int capacity, 
+    int occupancy,
+    int num_carriages
+);
 int compare_double(double n1, double n2);
 
 // Additional provided function prototypes
 // You won't need to use these functions!
 // We use just them to implement some of the provided helper functions.
-int scan_token(char *buffer, int buffer_size);
+int scan_token(struct input *input, char *buffer, int buffer_size);
 char *type_to_string(enum carriage_type type);
 enum carriage_type string_to_type(char *type_str);
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////  YOUR FUNCTION PROTOTYPE  /////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-struct carriage *create_carriage(char id[ID_SIZE], enum carriage_type type,
-                                 int capacity);
-struct carriage *add_carriage(struct carriage *head, int new_position, 
-                              char attachment);
-void print_train(struct carriage *head);
+struct carriage *create_carriage(struct pool *pool, char id[ID_SIZE], 
+                                 enum carriage_type type, int capacity);
+int add_carriage(struct train *train, int new_position, 
+                 struct command *command);
+void print_train(struct carriage *root);
+void print_carriage_range(struct carriage *root, int start, int end);
 int is_train_real(struct carriage *current);
 int is_type_valid(enum carriage_type type);
 int is_capacity_valid(int capacity);
 int validity(int test);
 int is_new_valid(char id[ID_SIZE], enum carriage_type type, int capacity, 
-                 struct carriage *head, int position);
-int is_id_in_train(char id[ID_SIZE], struct carriage *head);
+                 struct train *train, int position);
+int is_id_in_train(char id[ID_SIZE], struct train *train);
 int is_non_neg(int position);
-void is_loading_valid(struct carriage *head, char command);
+int is_loading_valid(struct train *train, struct command *command);
+int load_carriages(struct train *train, struct command *command);
+int load_carriage(struct carriage *current, char code, char id[ID_SIZE], 
+                  int total);
 int is_pos(int num);
 void add_passengers(struct carriage *current, int total, char command, 
                     char source_id[ID_SIZE]);
-void remove_passengers(struct carriage *current, int total, char command);
-struct carriage *find_id(struct carriage *current, char id[ID_SIZE]);
-struct space count_passengers(struct carriage *head, char start[ID_SIZE], 
+int remove_passengers(struct carriage *current, int total, char command);
+struct carriage *find_id(struct train *train, char id[ID_SIZE]);
+struct space count_passengers(struct train *train, char start[ID_SIZE], 
                               char end[ID_SIZE], char command);
-int find_id_index(struct carriage *current, char id[ID_SIZE]);
-void is_move_valid(struct carriage *head, char command);
-struct carriage *find_end(struct carriage *head);
+int is_move_valid(struct train *train, struct command *command);
+int is_move_space(struct train *train, struct carriage *source,
+                  struct carriage *destination, int to_move);
 int is_enough_passengers(struct carriage *curent, int to_move);
-struct train *create_train(void);
-int train_length(struct carriage *head);
-struct ends find_edges(struct carriage *head);
+struct train *create_train(struct pool *pool);
+int train_length(struct carriage *root);
+struct space train_totals(struct train *train);
 void print_all(struct train *selected);
+void print_trains(struct train *selected, int first, int num_trains);
+void print_trains_parallel(struct train *selected, int first, int end);
+void start_print_workers(void);
+void *run_print_worker(void *unused);
+void do_print_jobs(void);
+void stop_print_workers(void);
+void *summarise_trains(void *job);
 struct train *head_train(struct train *selected);
-struct carriage *remove_carriage(struct carriage *head, char id[ID_SIZE]);
+int remove_carriage(struct train *train, char id[ID_SIZE]);
 struct train *arrange_trains(struct train *selected);
 void remove_train(struct train *selected);
 void remove_all(struct train *selected);
-struct train *command_page(struct train *selected, char command);
-struct carriage *merge_dupes(struct carriage *current,
-                             struct carriage *next_carriage);
+struct train *command_page(struct train *selected, struct command *command);
+struct carriage *merge_dupes(struct train *selected,
+                             struct train *next_train);
 void merge_trains(struct train *selected);
-void split_trains(struct train *start);
-int split_train_once(struct train *selected, char id[ID_SIZE], 
-                     int *check_trains);
+int split_trains(struct train *start, struct command *command);
+int compare_positions(const void *a, const void *b);
+void cut_train(struct train *selected, int cuts[], int num_cuts);
+int save_network(struct train *selected, char *path);
+char *map_snapshot(char *path, long *length);
+struct train *load_network(struct train *selected, char *data, long length);
+struct directory *read_snapshot(struct pool *pool, char *data, long length,
+                                int *selected_number);
+int read_train(struct train *train, char *data, int num_carriages);
+int open_journal(char *path);
+int replay_journal(struct network_list *networks);
+int replay_load(struct network *network, char *data, long length);
+void journal_snapshot(char *data, long length);
+int read_record(char *data, long length, long *position, 
+                struct command *command);
+int read_bytes(char *data, long length, long *position, void *to, int size);
+void journal_command(struct command *command);
+void journal_put(void *data, int length);
+void journal_checkpoint(char *path);
+void flush_journal(void);
+int write_journal(char *data, int length);
+void sync_directory(char *path);
+void close_journal(void);
+struct directory *create_directory(void);
+void directory_insert(struct directory *directory, int number, 
+                      struct train *train);
+void directory_remove(struct directory *directory, int number);
+struct train *train_at(struct directory *directory, int number);
+void free_directory(struct directory *directory);
+struct network *create_network(int number);
+void free_network(struct network *network);
+struct network_list *create_network_list(void);
+void free_network_list(struct network_list *networks);
+void run_command(struct network_list *networks, struct command *command);
+unsigned int hash_id(char id[ID_SIZE]);
+struct carriage *index_find(struct id_index *index, char id[ID_SIZE]);
+void index_insert(struct id_index *index, struct carriage *carriage);
+void index_remove(struct id_index *index, char id[ID_SIZE]);
+void index_grow(struct id_index *index);
+void index_free(struct id_index *index);
+unsigned int carriage_priority(char id[ID_SIZE]);
+int subtree_size(struct carriage *root);
+struct space subtree_totals(struct carriage *root);
+void update_totals(struct carriage *carriage);
+long long subtree_happiness(struct carriage *root);
+int type_happiness(enum carriage_type type);
+long long happiness_points(struct carriage *carriage);
+double carriage_happiness(struct carriage *carriage);
+void print_carriage_happiness(struct train *train, char id[ID_SIZE]);
+void print_train_happiness(struct train *train);
+int optimise_happiness(struct train *train);
+int seats_above(struct carriage *root, double threshold);
+int carriage_seats_above(struct carriage *carriage, double threshold);
+void update_ancestors(struct carriage *carriage);
+void update_all_totals(struct carriage *root);
+struct carriage *build_carriages(struct carriage **carriages, int count);
+struct carriage *join_carriages(struct carriage *front, struct carriage *back);
+void split_carriages(struct carriage *root, int position, 
+                     struct carriage **front, struct carriage **back);
+void set_carriages(struct train *train, struct carriage *root);
+void unlink_carriage(struct train *train, struct carriage *carriage);
+struct carriage *find_start(struct carriage *root);
+struct carriage *next_carriage(struct carriage *current);
+struct carriage *carriage_at(struct carriage *root, int position);
+int carriage_position(struct carriage *carriage);
+struct space totals_before(struct carriage *carriage);
+struct carriage *find_last_seated(struct train *train, 
+                                  struct carriage *carriage, int total);
+int has_space(struct carriage *carriage);
+struct carriage *first_space(struct carriage *root);
+struct carriage *find_space(struct carriage *current);
+struct pool *create_pool(void);
+void lock_pool(struct pool *pool);
+void unlock_pool(struct pool *pool);
+struct carriage *pool_alloc_carriage(struct pool *pool);
+int carriage_slab_bytes(void);
+void pool_free_carriage(struct pool *pool, struct carriage *carriage);
+void pool_free_carriages(struct pool *pool, struct carriage *root);
+struct train *pool_alloc_train(struct pool *pool);
+void pool_free_train(struct pool *pool, struct train *train);
+void free_pool(struct pool *pool);
+void open_interactive(struct input *input);
+int open_batch(struct input *input, char *path);
+int read_all(struct input *input);
+void close_input(struct input *input);
+int refill_input(struct input *input);
+int peek_char(struct input *input);
+int next_char(struct input *input);
+void skip_space(struct input *input);
+int scan_int(struct input *input);
+int scan_command(struct input *input, struct command *command);
+void reserve_ids(struct command *command, int count);
+int parse_options(int argc, char *argv[], struct options *options);
+void open_output(int fd, int is_quiet);
+void flush_output(void);
+void write_all(char *text, int length);
+void close_output(void);
+void write_out(char *text, int length);
+void vprint_out(char *format, va_list args);
+void print_out(char *format, ...);
+void print_confirmation(char *format, ...);
+void print_prompt(char *prompt);
+void *allocate(size_t size);
+void *allocate_zeroed(size_t count, size_t size);
+void *allocate_aligned(size_t alignment, size_t size);
+void *reallocate(void *old, size_t size);
+void deallocate(void *memory_block);
+unsigned int next_random(unsigned int *seed);
+void number_to_id(int number, char id[ID_SIZE]);
+long elapsed_ns(struct timespec *start);
+int latency_bucket(long ns);
+long bucket_latency(int bucket);
+void record_command(char code, long ns);
+long latency_at(struct command_stats *command, double share);
+void print_stats(struct stats *totals);
+void merge_stats(void);
+void dump_stats(char *path);
+struct train *build_network(struct pool *pool, struct directory *directory,
+                            int num_trains, int num_carriages, 
+                            unsigned int *seed);
+int bench_ops(char code, int num_trains, int num_carriages);
+void fill_bench_command(struct command *command, int op, int num_carriages,
+                        unsigned int *seed);
+void bench_command(char code, int num_trains, int num_carriages);
+void run_benchmarks(int num_trains, int num_carriages);
+int random_below(unsigned int *seed, int limit);
+void generated_insert_train(struct generator *generator, int position);
+void generated_remove_train(struct generator *generator, int position);
+void generated_insert(struct generated_train *train, int position, 
+                      struct generated_carriage carriage);
+void generated_remove(struct generated_train *train, int position);
+void generate_add(struct generator *generator, char code);
+void generate_passengers(struct generator *generator, char code);
+void generate_move(struct generator *generator);
+void generate_count(struct generator *generator);
+void generate_split(struct generator *generator);
+void generate_merge(struct generator *generator);
+void generate_navigation(struct generator *generator, char code);
+void generate_command(struct generator *generator, int command_number);
+void run_generator(unsigned int seed, int count);
+int run_shards(char *paths[], int num_shards, int is_quiet);
+void *run_shard(void *shard);
+int run_desks(char *paths[], int num_desks, int is_quiet);
+void *run_desk(void *desk);
+void desk_command(struct desk *desk, struct command *command);
+int is_structural(char code);
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-int main(void) {
-    printf("Welcome to Carriage Simulator\n");
-    printf("All aboard!\n");
+int main(int argc, char *argv[]) {
+    struct options options;
+    if (!parse_options(argc, argv, &options)) {
+        return 1;
+    }
+    if (options.is_bench) {
+        open_output(STDOUT_FILENO, VALID);
+        run_benchmarks(options.bench_trains, options.bench_carriages);
+        stop_print_workers();
+        close_output();
+        return 0;
+    }
+    if (options.is_generate) {
+        open_output(STDOUT_FILENO, VALID);
+        run_generator(options.generate_seed, options.generate_count);
+        close_output();
+        return 0;
+    }
+    if (options.num_desks > 0) {
+        int is_run = run_desks(options.desk_paths, options.num_desks, 
+                               options.is_quiet);
+        stop_print_workers();
+        dump_stats(options.stats_path);
+        return !is_run;
+    }
+    if (options.num_shards > 0) {
+        int is_run = run_shards(options.shard_paths, options.num_shards, 
+                                options.is_quiet);
+        stop_print_workers();
+        dump_stats(options.stats_path);
+        return !is_run;
+    }
+
+    // In batch mode the commands are all read at once, from the given file
+    // or from stdin. Otherwise they are read as they are typed.
+    struct input input;
+    if (options.is_batch) {
+        if (!open_batch(&input, options.batch_path)) {
+            fprintf(stderr, "ERROR: Cannot read commands from '%s'\n", 
+                    options.batch_path);
+            return 1;
+        }
+    } else {
+        open_interactive(&input);
+    }
+    if (options.journal_path != NULL && !open_journal(options.journal_path)) {
+        fprintf(stderr, "ERROR: Cannot open journal '%s'\n", 
+                options.journal_path);
+        close_input(&input);
+        return 1;
+    }
+    open_output(STDOUT_FILENO, options.is_quiet);
+
+    print_out("Welcome to Carriage Simulator\n");
+    print_out("All aboard!\n");
 
-    // Pointer to our first train when our program starts. 
-    // All carriages are stored here until we change trains.
-    struct train *trains = create_train();
+    // Every network we host, starting with one network of one train.
+    // Each network keeps track of which of its trains we have selected.
+    struct network_list *networks = create_network_list();
 
-    // We also need another pointer to keep track of 
-    // which train we have selected.
-    struct train *selected = trains;
+    // A journal left by an earlier run is carried out again first.
+    if (options.journal_path != NULL && !replay_journal(networks)) {
+        free_network_list(networks);
+        close_input(&input);
+        close_output();
+        return 1;
+    }
 
     // Loops through the commands provided by the user
-    //TURN THIS INTO A FUNCTION
-    printf("Enter command: ");
-    char command;
-    while (scanf(" %c", &command) != EOF) {
-        selected = command_page(selected, command);
-        printf("Enter command: ");
+    struct command command;
+    command.ids = NULL;
+    command.loads = NULL;
+    command.ids_size = 0;
+    print_prompt("Enter command: ");
+    while (scan_command(&input, &command)) {
+        run_command(networks, &command);
+        print_prompt("Enter command: ");
     }
-    remove_all(selected);
-    printf("\nGoodbye\n");
+    stop_print_workers();
+    close_journal();
+    free_network_list(networks);
+    deallocate(command.ids);
+    deallocate(command.loads);
+    close_input(&input);
+    print_out("\nGoodbye\n");
+    close_output();
+    dump_stats(options.stats_path);
 
     return 0;
 }
@@ -194,83 +935,74 @@ int main(void) {
 /////////////////////////////  YOUR FUNCTIONS //////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-// Mallocs a new node and then inserts the input data into the carriage node
+// Allocates a new node and then inserts the input data into the carriage node
 // 
 // Parameters:
+//      *pool       - struct *, pool to allocate the node from
 //      id[ID_SIZE] - string, which contains the carriage ID
 //      type        - enum, what type the carriage node is
 //      capacity    - int capacity of the carriage node
 // Returns:
 //      The new node filled with the data
 //
-struct carriage *create_carriage(char id[ID_SIZE], enum carriage_type type,
-                                 int capacity) {
-    // malloc the new node
-    struct carriage *new = malloc(sizeof(struct carriage));
+struct carriage *create_carriage(struct pool *pool, char id[ID_SIZE], 
+                                 enum carriage_type type, int capacity) {
+    // allocate the new node
+    struct carriage *new = pool_alloc_carriage(pool);
     
     // copy the inputs into the new carriage node
     strcpy(new->carriage_id, id);
     new->type = type;
     new->capacity = capacity;
     new->occupancy = 0;
-    new->next = NULL;
+    new->left = NULL;
+    new->right = NULL;
+    new->parent = NULL;
+    new->priority = carriage_priority(id);
+    update_totals(new);
     // return the node filled with data.
     return new; 
 }
 
-// Scans in the values for the carriage. Then, 
-// Inserts a new carriage at the inputted position in the linked list.
+// Inserts a new carriage at the inputted position in the train.
 //
 // Parameters: 
-//      *head       - struct *, contains the head pointer of the linked list.
+//      *train      - struct *, train to insert the carriage into.
 //      new_position- int, index at which the carriage should be inserted
-//      command     - char, command given by the user
+//      *command    - struct *, command given by the user, with the ID,
+//                              type and capacity of the carriage
+//
 // Returns:
-//      The new head node, if it has changed.
+//      VALID   - if the command was carried out
+//      INVALID - if not
 //
-struct carriage *add_carriage(struct carriage *head, int new_position,
-                              char attachment) {
-    // Scans in the values for the carriage provided by the user
-    char new_id[ID_SIZE];
-    scan_id(new_id);
-    enum carriage_type new_type = scan_type();
-    int new_capacity;
-    scanf(" %d", &new_capacity);
+int add_carriage(struct train *train, int new_position, 
+                 struct command *command) {
+    char *new_id = command->id;
+    enum carriage_type new_type = command->type;
+    int new_capacity = command->capacity;
 
-    struct carriage *current = head;
     // checks if the carriage data is valid
-    if (is_new_valid(new_id, new_type, new_capacity, head, new_position)) {
-        struct carriage *new = create_carriage(new_id, new_type, new_capacity);  
-        // checks if carriages exist, 
-        // then loops through to the inputted position along the linked list. 
-        if (is_train_real(head)) {     
-            int i = 0;       
-            while (i < new_position - 1 && current->next != NULL) {
-                current = current->next;
-                i++;
-            }
-            // Appends the new carriage to the the list.
-            if (new_position == 0) {
-                new->next = head;
-                head = new;
-            } else {       
-                new->next = current->next;
-                current->next = new;
-            }
-        } else {
-            // points head to the newly created node.
-            head = new;
-        }
+    if (is_new_valid(new_id, new_type, new_capacity, train, new_position)) {
+        struct carriage *new = create_carriage(train->pool, new_id, new_type, 
+                                               new_capacity);
+        // splits the train at the inputted position, positions past the end
+        // of the train append the new carriage.
+        struct carriage *front;
+        struct carriage *back;
+        split_carriages(train->carriages, new_position, &front, &back);
+        set_carriages(train, join_carriages(join_carriages(front, new), back));
+        index_insert(&train->index, new);
         
         // Print confirmation of carriage attached
-        if (attachment == ADD) {
-            printf("Carriage: '%s' attached!\n", new_id);
+        if (command->code == ADD) {
+            print_confirmation("Carriage: '%s' attached!\n", new_id);
         } else {
-            printf("Carriage: '%s' inserted!\n", new_id);
+            print_confirmation("Carriage: '%s' inserted!\n", new_id);
         }
+        return VALID;
     }
-    // returns the potentially updated starting node.
-    return head;
+    return INVALID;
 }
 
 // Checks if carriages exist in the linked list
@@ -294,32 +1026,32 @@ int is_train_real(struct carriage *current) {
 //      id[ID_SIZE] - string, which contains the carriage ID
 //      type        - enum, what type the carriage node is
 //      capacity    - int capacity of the carriage node
-//      *head       - struct *, contains the head pointer of the linked list.
+//      *train      - struct *, train the carriage will be added to.
 //
 // Return:
 //      VALID   - if valid (all checks pass)
 //      INVALID - if invalid (at least 1 check fails)
 //
 int is_new_valid(char id[ID_SIZE], enum carriage_type type, int capacity, 
-                 struct carriage *head, int position) {
+                 struct train *train, int position) {
     // test if position is positive
     if (!is_non_neg(position)) {
-        printf("ERROR: n must be at least 0\n");
+        print_out("ERROR: n must be at least 0\n");
         return INVALID;        
     }
     // test if carriage type
     else if (!is_type_valid(type)) {
-        printf("ERROR: Invalid carriage type\n");
+        print_out("ERROR: Invalid carriage type\n");
         return INVALID;
     }
     // test capacity
     else if (!is_capacity_valid(capacity)) {
-        printf("ERROR: Capacity should be between 1 and 999\n");
+        print_out("ERROR: Capacity should be between 1 and 999\n");
         return INVALID;       
     } 
     // test if ID has been used already
-    else if (is_id_in_train(id, head)) {
-        printf("ERROR: a carriage with id: '%s' already exists in this train\n", 
+    else if (is_id_in_train(id, train)) {
+        print_out("ERROR: a carriage with id: '%s' already exists in this train\n", 
                 id);
         return INVALID;
     } else {
@@ -383,23 +1115,14 @@ int is_capacity_valid(int capacity) {
 //
 // Parameters: 
 //      id[ID_SIZE] - string, which contains the carriage ID
-//      *head       - struct *, contains the head pointer of the linked list.
+//      *train      - struct *, train to search.
 //
 // Return:
 //      VALID   - if id is in linked list
 //      INVALID - if not
 //
-int is_id_in_train(char id[ID_SIZE], struct carriage *head) {
-    if (is_train_real(head)) {
-        struct carriage *current = head;
-        while (current != NULL) {
-            if (strcmp(current->carriage_id, id) == 0) {
-                return VALID;
-            }
-            current = current->next;  
-        }     
-    }
-    return INVALID;
+int is_id_in_train(char id[ID_SIZE], struct train *train) {
+    return validity(find_id(train, id) != NULL);
 }
 
 // Checks if input is true or false
@@ -419,92 +1142,163 @@ int validity(int test) {
     }
 }
 
-// Checks if there are nodes in the linked list.
-// If there is, loops through the list and prints each node's data. 
+// Prints the carriages of a train from position start up to, but not 
+// including, position end. The tree is used to go straight to the first 
+// carriage, so only the printed carriages are visited. 
+// Positions past the end of the train are left out.
+//
+// Parameters: 
+//      *root   - struct *, the root of the train's carriage tree.
+//      start   - int, position of the first carriage to print
+//      end     - int, position to stop printing at
+//
+void print_carriage_range(struct carriage *root, int start, int end) {
+    if (!is_non_neg(start) || end < start) {
+        print_out("ERROR: Invalid range\n");
+    }
+    else if (!is_train_real(root)) {
+        print_out("This train is empty!\n");
+    } else {
+        struct carriage *current = carriage_at(root, start);
+        int position = start;
+        while (current != NULL && position < end) {
+            print_carriage(current);
+            current = next_carriage(current);
+            position++;
+        }
+    }
+}
+
+// Checks if there are carriages in the train.
+// If there is, loops through the carriages in order and prints their data. 
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
+//      *root   - struct *, the root of the train's carriage tree.
 //
-void print_train(struct carriage *head) {
-    struct carriage *current = head;
+void print_train(struct carriage *root) {
+    struct carriage *current = find_start(root);
 
-    // checks if linked list is empty, if not prints the linked lists' data.
-    if (is_train_real(head)) {
+    // checks if train is empty, if not prints the carriages' data.
+    if (is_train_real(root)) {
         while (current != NULL) {
             print_carriage(current);
-            current = current->next;
+            current = next_carriage(current);
         }
     } else {
-        printf("This train is empty!\n");
+        print_out("This train is empty!\n");
     }
 }
 
-// scans in the inputs and checks to ensure input is valid
+// checks to ensure input is valid
 // then calls function to add/remove passengers from the train.
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
-//      command     - char, command given by the user
+//      *train      - struct *, train to load or unload.
+//      *command    - struct *, command given by the user
 //
-void is_loading_valid(struct carriage *head, char command) {
-    char id[ID_SIZE];
-    scan_id(id);
-    int total;
-    scanf(" %d", &total);
+// Returns:
+//      VALID   - if the command was carried out
+//      INVALID - if not
+//
+int is_loading_valid(struct train *train, struct command *command) {
+    // find the node of the carriage id provided
+    struct carriage *current = find_id(train, command->id);
+    return load_carriage(current, command->code, command->id, command->n);
+}
 
-    if (!is_pos(total)) {
-        printf("ERROR: n must be a positive integer\n");
-    } 
-    else if (!is_train_real(head) || !is_id_in_train(id, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", id);
-    } else {
-        
-        // find the node of the carriage id provided
-        struct carriage *current = find_id(head, id);
-        if (command == SEAT) {
-            add_passengers(current, total, command, id);
-        } else {
-            remove_passengers(current, total, command);
+// Seats or removes passengers for a list of carriages, in the order 
+// given, exactly as if each were its own 's' or 'd' command. Every ID is 
+// looked up in the train's index before any passengers move, as seating 
+// and removing passengers never changes which carriage holds an ID. The 
+// loads aren't sorted by position, since seats filled by one load's 
+// overflow have to be taken before a later load reaches them.
+//
+// Parameters: 
+//      *train      - struct *, train to load or unload.
+//      *command    - struct *, command given by the user, with the IDs
+//                    and the passengers for each
+//
+// Returns:
+//      VALID   - if any of the loads were carried out
+//      INVALID - if not
+//
+int load_carriages(struct train *train, struct command *command) {
+    int num_loads = command->n;
+    if (!is_pos(num_loads)) {
+        print_out("ERROR: n must be a positive integer\n");
+        return INVALID;
+    }
+    char code = SEAT;
+    if (command->code == BULK_DISEMBARK) {
+        code = DISEMBARK;
+    }
+
+    struct carriage **carriages = allocate(num_loads 
+                                           * sizeof(struct carriage *));
+    int load = 0;
+    while (load < num_loads) {
+        carriages[load] = find_id(train, command->ids[load]);
+        load++;
+    }
+
+    int is_applied = INVALID;
+    load = 0;
+    while (load < num_loads) {
+        if (load_carriage(carriages[load], code, command->ids[load], 
+                          command->loads[load])) {
+            is_applied = VALID;
         }
+        load++;
     }
+    deallocate(carriages);
+    return is_applied;
 }
 
-// Loops through list to find node with a given carriage id
+// Checks a load is valid, then adds or removes the passengers.
 //
 // Parameters: 
-//      current - struct *, starting node to search from
-//      id      - char, id of the carriage to find
+//      *current    - struct *, carriage to load, or NULL if the ID 
+//                    wasn't found
+//      code        - char, SEAT or DISEMBARK
+//      id          - char, id the carriage was looked up with
+//      total       - int, number of passengers to seat or remove
 //
-// Return:
-//      pointer to the node containing id.
+// Returns:
+//      VALID   - if the passengers were seated or removed
+//      INVALID - if not
 //
-struct carriage *find_id(struct carriage *current, char id[ID_SIZE]) {
-    while (strcmp(current->carriage_id, id) != 0) {
-        current = current->next;
+int load_carriage(struct carriage *current, char code, char id[ID_SIZE], 
+                  int total) {
+    if (!is_pos(total)) {
+        print_out("ERROR: n must be a positive integer\n");
+    } 
+    else if (current == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", id);
+    } 
+    else if (code == SEAT) {
+        add_passengers(current, total, code, id);
+        return VALID;
+    } else {
+        return remove_passengers(current, total, code);
     }
-    return current;
+    return INVALID;
 }
 
-// Loops through list to find index of a given carriage id
+// Looks up the node with a given carriage id in the train's index
 //
 // Parameters: 
-//      current - struct *, starting node to search from
+//      *train  - struct *, train to search
 //      id      - char, id of the carriage to find
 //
 // Return:
-//      position in the linked list of the node containing id.
+//      pointer to the node containing id, or NULL if it is not in the train.
 //
-int find_id_index(struct carriage *current, char id[ID_SIZE]) {
-    int count = 0;
-    while (strcmp(current->carriage_id, id) != 0) {
-        count++;
-        current = current->next;
-    }
-    return count;
+struct carriage *find_id(struct train *train, char id[ID_SIZE]) {
+    return index_find(&train->index, id);
 }
 
 // adds passengers to the carriages, overflow passengers are seated in 
-// proceeding carriages
+// proceeding carriages. Full carriages are skipped over using the tree.
 //
 // Parameters: 
 //      *current    - struct *, contains a pointer to where to add passengers
@@ -512,31 +1306,32 @@ int find_id_index(struct carriage *current, char id[ID_SIZE]) {
 //
 void add_passengers(struct carriage *current, int total, char command, 
                     char source_id[ID_SIZE]) {
-    // Loops through the linked list until all passengers are loaded 
-    // or we reach the end of the linked list. 
+    // Loops through the carriages with free seats until all passengers 
+    // are loaded or we reach the end of the train. 
+    current = find_space(current);
     while (total > 0 && current != NULL) {
-        int count = 0;
         // fills up carriage until carriage is full or no more passengers
         // are required to load the train. 
-        while (current->capacity > current->occupancy && total > 0) {
-            current->occupancy++;
-            count++;
-            total--;
-        }
-        if (count > 0) {
-            if (command == SEAT) {
-                printf("%d passengers added to %s\n", count, 
-                        current->carriage_id);
-            }
-            else if (command == MOVE) {
-                printf("%d passengers moved from %s to %s\n", count, source_id,
-                        current->carriage_id);
-            }
+        int count = current->capacity - current->occupancy;
+        if (count > total) {
+            count = total;
         }
-        current = current->next;
+        current->occupancy += count;
+        total -= count;
+        update_ancestors(current);
+
+        if (command == SEAT) {
+            print_confirmation("%d passengers added to %s\n", count, 
+                               current->carriage_id);
+        }
+        else if (command == MOVE) {
+            print_confirmation("%d passengers moved from %s to %s\n", count, 
+                               source_id, current->carriage_id);
+        }
+        current = find_space(next_carriage(current));
     }
     if (total > 0) {
-        printf("%d passengers could not be seated\n", total);
+        print_out("%d passengers could not be seated\n", total);
     }
 }
 
@@ -546,18 +1341,24 @@ void add_passengers(struct carriage *current, int total, char command,
 //      *current    - struct *, contains a pointer to where to remove passengers
 //      total       - int, total number of passengers to remove
 //
-void remove_passengers(struct carriage *current, int total, char command) {
+// Returns:
+//      VALID   - if the passengers were removed
+//      INVALID - if there weren't enough passengers
+//
+int remove_passengers(struct carriage *current, int total, char command) {
     // checks if theres enough passengers and removes them.
     if (!is_enough_passengers(current, total)) {
-        printf("ERROR: Cannot remove %d passengers from %s\n", total, 
+        print_out("ERROR: Cannot remove %d passengers from %s\n", total, 
             current->carriage_id);
-    } else {
-        current->occupancy -= total;
-        if (command == DISEMBARK) {
-            printf("%d passengers removed from %s\n", total, 
-                    current->carriage_id);
-        }
+        return INVALID;
+    }
+    current->occupancy -= total;
+    update_ancestors(current);
+    if (command == DISEMBARK) {
+        print_confirmation("%d passengers removed from %s\n", total, 
+                           current->carriage_id);
     }
+    return VALID;
 }
 
 // Checks if theres enough occupants when moving passengers
@@ -578,7 +1379,7 @@ int is_enough_passengers(struct carriage *current, int to_move) {
 // then prints out the occupied and unoccupied seats
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
+//      *train  - struct *, train to count the passengers of.
 //      start   - char, carriage id of the starting carriage
 //      end     - char, carriage id of the ending carriage  
 //      command - char, command given by the user
@@ -586,128 +1387,141 @@ int is_enough_passengers(struct carriage *current, int to_move) {
 // Return:
 //      number of available seats in the range of carriages.
 // 
-struct space count_passengers(struct carriage *head, char start[ID_SIZE], 
+struct space count_passengers(struct train *train, char start[ID_SIZE], 
                               char end[ID_SIZE], char command) {
     struct space total;   
     total.occupied = INVALID;
     total.unoccupied = INVALID;
     total.capacity = INVALID;               
-    if (!is_id_in_train(start, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", start);
+    struct carriage *first = find_id(train, start);
+    struct carriage *last = find_id(train, end);
+    if (first == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", start);
+        return total;
     }
-    else if (!is_id_in_train(end, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", end);
+    else if (last == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", end);
+        return total;
     }
-    else if (find_id_index(head, start) > find_id_index(head, end)) {
-        printf("ERROR: Carriages are in the wrong order\n");
+
+    if (carriage_position(first) > carriage_position(last)) {
+        print_out("ERROR: Carriages are in the wrong order\n");
     } else {
-        struct carriage *current = find_id(head, start);
-        // stop at the node after the end node so we can count it too. 
-        struct carriage *stop = find_id(head, end)->next;
-        int passengers = 0;
-        int seats = 0;
-        // count seats and capacity until the end node
-        while (current != stop) {
-            passengers += current->occupancy;
-            seats += current->capacity;
-            current = current->next;
-        }
+        // count seats and capacity up to and including the end node, 
+        // then take away the seats and capacity before the start node.
+        struct space before_start = totals_before(first);
+        struct space before_end = totals_before(last);
+        int passengers = before_end.occupied + last->occupancy 
+                         - before_start.occupied;
+        int seats = before_end.capacity + last->capacity 
+                    - before_start.capacity;
 
         total.occupied = passengers;
         total.unoccupied = seats - passengers;
         total.capacity = seats;
 
-        // Print message depending on 'T' or 'c' command
+        // Print message for the 'c' command
         if (command == COUNT) {
-            printf("Occupancy: %d\n", total.occupied);
-            printf("Unoccupied: %d\n", total.unoccupied);
+            print_out("Occupancy: %d\n", total.occupied);
+            print_out("Unoccupied: %d\n", total.unoccupied);
         } 
-        else if (command == TOTAL) {
-            printf("Total occupancy: %d\n", total.occupied);
-            printf("Unoccupied capacity: %d\n", total.unoccupied);            
-        }
         return total;
     }
     return total;
 }
 
 // Checks to ensure the capacity, source and destinations ids are valid, 
-// then moves the passengers around.  
+// then moves the passengers around. Whether they fit is worked out before
+// anything is changed, so a move that fails leaves the train as it was.
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
-//      command - char, command given by the user
+//      *train      - struct *, train to move the passengers within.
+//      *command    - struct *, command given by the user
 //
-void is_move_valid(struct carriage *head, char command) {
-    char source_id[ID_SIZE];
-    scan_id(source_id);
-    char destination_id[ID_SIZE];
-    scan_id(destination_id);    
-    int to_move;
-    scanf(" %d", &to_move);
+// Returns:
+//      VALID   - if the command was carried out
+//      INVALID - if not
+//
+int is_move_valid(struct train *train, struct command *command) {
+    char *source_id = command->id;
+    char *destination_id = command->other_id;
+    int to_move = command->n;
 
+    struct carriage *source = find_id(train, source_id);
+    struct carriage *destination = find_id(train, destination_id);
     if (!is_pos(to_move)) {
-        printf("ERROR: n must be a positive integer\n");
+        print_out("ERROR: n must be a positive integer\n");
     }
-    else if (!is_id_in_train(source_id, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", source_id);
+    else if (source == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", source_id);
     }
-    else if (!is_enough_passengers(find_id(head, source_id), to_move)) {
-        printf("ERROR: Cannot remove %d passengers from %s\n", 
+    else if (!is_enough_passengers(source, to_move)) {
+        print_out("ERROR: Cannot remove %d passengers from %s\n", 
                to_move, source_id);
     }
-    else if (!is_id_in_train(destination_id, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", destination_id);
+    else if (destination == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", destination_id);
+    }
+    else if (!is_move_space(train, source, destination, to_move)) {
+        print_out("ERROR: not enough space to move passengers\n");
     } else {
-        // unboards the passengers wanting to move
-        struct carriage *source = find_id(head, source_id);
+        // unboards the passengers wanting to move, then seats them from
+        // the destination onwards.
         remove_passengers(source, to_move, BLANK);
-        // Counts to see how many seats are available at the carriage 
-        // + following carriages. 
-        // BLANK command used since we dont want to print anything.
-        struct space total = count_passengers(head, destination_id, 
-                             find_end(head)->carriage_id, BLANK);
-        struct carriage *destination = find_id(head, destination_id);                                
-        // if no room, passengers are returned to original carriage.
-        if (to_move > total.unoccupied) {
-            add_passengers(source, to_move, BLANK, source_id);
-            printf("ERROR: not enough space to move passengers\n");
-        } else {
-            add_passengers(destination, to_move, MOVE, source_id);
-        }
+        add_passengers(destination, to_move, MOVE, source_id);
+        return VALID;
     }
+    return INVALID;
 }
 
-// Loops to end of linked link and returns the last carriage
+// Checks if passengers moved out of the source carriage would all fit from 
+// the destination carriage onwards, without moving anyone. 
+// If the source is at or after the destination, the seats they leave are 
+// in range, so they always fit. Otherwise the source doesn't change the 
+// free seats from the destination on, which the tree has cached.
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
-//      end     - char, carriage id of the ending carriage  
+//      *train          - struct *, train to move the passengers within.
+//      *source         - struct *, carriage to move passengers out of
+//      *destination    - struct *, carriage to start seating them from
+//      to_move         - int, number of passengers, at least 1
 //
 // Return:
-//      struct * to the last carriage in the linked list
-// 
-struct carriage *find_end(struct carriage *head) {
-    struct carriage *current = head;
-    while (current->next != NULL) {
-        current = current->next;  
-    } 
-    return current;
+//      VALID   - if the passengers fit
+//      INVALID - if not
+//
+int is_move_space(struct train *train, struct carriage *source,
+                  struct carriage *destination, int to_move) {
+    if (carriage_position(source) >= carriage_position(destination)) {
+        return VALID;
+    }
+    return validity(find_last_seated(train, destination, to_move) != NULL);
 }
 
-// Mallocs a new node and then inserts the input data into the train node
+// Allocates a new node and then inserts the input data into the train node.
+// The train is not in a directory until directory_insert is called.
 // 
+// Parameters:
+//      *pool   - struct *, pool to allocate the node from
+//
 // Returns:
 //      The new node filled with NULL in all fields
 //
-struct train *create_train(void) {
-    // malloc the new node
-    struct train *new = malloc(sizeof(struct train));
+struct train *create_train(struct pool *pool) {
+    // allocate the new node
+    struct train *new = pool_alloc_train(pool);
 
     // Creates blank data for the new train.
     new->carriages = NULL;
-    new->next = NULL;
-    new->previous = NULL;
+    new->index.slots = NULL;
+    new->index.size = 0;
+    new->index.count = 0;
+    new->pool = pool;
+    new->directory = NULL;
+    new->number = 0;
+    new->next_free = NULL;
+    pthread_mutex_init(&new->lock, NULL);
+    new->num_desks = 0;
     // return the node filled with data.
     return new; 
 }
@@ -729,30 +1543,28 @@ int is_selected(struct train *selected, struct train *position) {
 // Counts the number of carriages in the train
 //
 // Parameters: 
-//      head    - struct *, start carriage of linked list.
+//      root    - struct *, the root of the train's carriage tree.
 //
 // Return:
 //      Number of carriages in the train.
 //
-int train_length(struct carriage *head) {
-    return find_id_index(head, find_end(head)->carriage_id) + 1;
+int train_length(struct carriage *root) {
+    return subtree_size(root);
 }
 
-// Finds the ID's of the start and end carriages
+// Finds the total capacity and occupancy of the train. 
+// These are kept up to date at the root of the carriage tree by every
+// change to the train, so no carriages need to be visited.
 //
 // Parameters: 
-//      head    - struct *, start carriage of linked list.
+//      *train  - struct *, train to total.
 //
 // Return:
-//      ID's of the start and end carriages.
+//      capacity, occupied and unoccupied seats of the train, 
+//      all 0 if the train is empty.
 //
-struct ends find_edges(struct carriage *head) {
-    struct ends train_ends;
-    // finds the first carriage in train's ID
-    strcpy(train_ends.start, head->carriage_id);
-    // finds the last carriage in train's ID
-    strcpy(train_ends.end, find_end(head)->carriage_id);
-    return train_ends;
+struct space train_totals(struct train *train) {
+    return subtree_totals(train->carriages);
 }
 
 // Prints all the trains in the station
@@ -761,478 +1573,4411 @@ struct ends find_edges(struct carriage *head) {
 //      selected    - struct *, current train selected in the main function
 //
 void print_all(struct train *selected) {
-    struct train *position = selected;
-    // Cycle to first train in linked list.
-    position = head_train(position);
+    print_trains(selected, 0, selected->directory->count);
+}
+
+// Prints the trains numbered from first, up to num_trains of them. 
+// Trains past the end of the directory are left out.
+//
+// Parameters: 
+//      selected    - struct *, current train selected in the main function
+//      first       - int, number of the first train to print, at least 0
+//      num_trains  - int, number of trains to print
+//
+void print_trains(struct train *selected, int first, int num_trains) {
+    struct directory *directory = selected->directory;
+    if (num_trains > directory->count - first) {
+        num_trains = directory->count - first;
+    }
+    if (num_trains >= PARALLEL_PRINT_TRAINS) {
+        print_trains_parallel(selected, first, first + num_trains);
+        return;
+    }
 
     int selection;
-    int count = 0;
-    struct ends train_ends;
+    int count = first;
     struct space total;
     int length;
-    while (position != NULL) {
+    while (count < directory->count && count - first < num_trains) {
+        struct train *position = directory->trains[count];
         // checks if train is currently selected train.
         selection = is_selected(selected, position);
-        total.capacity = INVALID;
-        total.occupied = INVALID;
-        length = INVALID;
-        // If carriages exist, find the correct data. 
-        if (is_train_real(position->carriages)) {
-            // finds start and end ID's for the count_passengers function
-            train_ends = find_edges(position->carriages);
-            // finds the capacity and occupancy
-            total = count_passengers(position->carriages, train_ends.start, 
-                                    train_ends.end, BLANK);
-
-            // finds number of carriages in the train.
-            length = train_length(position->carriages);
-        }
-        // Pints the train summary
+        // finds the capacity, occupancy and number of carriages.
+        total = train_totals(position);
+        length = train_length(position->carriages);
+        // Pints the train summary, numbered by its place in the directory
         print_train_summary(selection, count, total.capacity, total.occupied,
                             length);
-        // tracks position of the given train
         count++;
-        position = position->next;
     }
 }
 
-// Cycles to the first train in the linked list
+// Prints the summaries of a long run of trains, split between the print 
+// workers. Each run of trains is formatted into its own buffer, and the 
+// buffers are printed in train order, so the output is the same as 
+// printing them one by one.
 //
 // Parameters: 
-//      *selected   - struct *, some node along the train linked list.
+//      selected    - struct *, current train selected in the main function
+//      first       - int, number of the first train to print
+//      end         - int, number of the train after the last one to print
 //
-// Returns:
-//      The head node of the train linked list.
+void print_trains_parallel(struct train *selected, int first, int end) {
+    int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > PRINT_WORKERS) {
+        num_workers = PRINT_WORKERS;
+    }
+    if (num_workers > (end - first) / PRINT_WORKER_TRAINS) {
+        num_workers = (end - first) / PRINT_WORKER_TRAINS;
+    }
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+
+    // each run's buffer size is known from its length, so every buffer is
+    // allocated here and freed once printed, leaving the workers to just
+    // format into memory that they alone write to
+    struct summary_job jobs[PRINT_WORKERS];
+    int worker = 0;
+    while (worker < num_workers) {
+        jobs[worker].selected = selected;
+        jobs[worker].first = first 
+            + (long)(end - first) * worker / num_workers;
+        jobs[worker].end = first 
+            + (long)(end - first) * (worker + 1) / num_workers;
+        jobs[worker].text = allocate((jobs[worker].end - jobs[worker].first) 
+                                     * SUMMARY_SIZE);
+        jobs[worker].length = 0;
+        worker++;
+    }
+
+    // this thread takes runs too, so every run is done even if no worker 
+    // could be started
+    pthread_mutex_lock(&print_pool.use_lock);
+    if (!print_pool.is_started) {
+        start_print_workers();
+    }
+    pthread_mutex_lock(&print_pool.lock);
+    print_pool.jobs = jobs;
+    print_pool.num_jobs = num_workers;
+    print_pool.next_job = 0;
+    print_pool.num_done = 0;
+    pthread_cond_broadcast(&print_pool.has_jobs);
+    do_print_jobs();
+    while (print_pool.num_done < print_pool.num_jobs) {
+        pthread_cond_wait(&print_pool.is_done, &print_pool.lock);
+    }
+    print_pool.jobs = NULL;
+    print_pool.num_jobs = 0;
+    print_pool.next_job = 0;
+    pthread_mutex_unlock(&print_pool.lock);
+    pthread_mutex_unlock(&print_pool.use_lock);
+
+    worker = 0;
+    while (worker < num_workers) {
+        write_out(jobs[worker].text, jobs[worker].length);
+        deallocate(jobs[worker].text);
+        worker++;
+    }
+}
+
+// Starts the print workers, one fewer than there are processors, as the 
+// printing thread works too. Called with the pool's use_lock held.
 //
-struct train *head_train(struct train *selected) {
-    struct train *position = selected;
-    // Cycle to first train in linked list.
-    while (position->previous != NULL) {
-        position = position->previous;
-    }   
-    return position;
+void start_print_workers(void) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (num_threads > PRINT_WORKERS) {
+        num_threads = PRINT_WORKERS;
+    }
+    print_pool.num_threads = 0;
+    while (print_pool.num_threads < num_threads 
+           && pthread_create(&print_pool.threads[print_pool.num_threads], 
+                             NULL, run_print_worker, NULL) == 0) {
+        print_pool.num_threads++;
+    }
+    print_pool.is_started = VALID;
 }
 
-// Removes the carriage from the train.
+// Waits for runs of trains and summarises them, until the workers are 
+// stopped.
 //
 // Parameters: 
-//      *head   - struct *, contains the head pointer of the linked list.
-//      id      - string of the carriage ID.
+//      *unused     - void *, not used
 //
 // Returns:
-//      The new head node, if it has changed.
+//      NULL
 //
-struct carriage *remove_carriage(struct carriage *head, char id[ID_SIZE]) {
-    // Error Testing if ID is in train.
-    if (!is_id_in_train(id, head)) {
-        printf("ERROR: No carriage exists with id: '%s'\n", id);
-        return head;
-    }
-
-    // Checks if we need to remove the first carriage and removes it.
-    struct carriage *current = head;
-    if (strcmp(current->carriage_id, id) == 0) {
-        head = current->next;
-        free(current);
-        return head;
-    } 
-
-    // Goes to 2nd carriage and finds the carriage to remove and removes it.
-    struct carriage *previous = current;
-    current = current->next;
-    while (current != NULL) {
-        if (strcmp(current->carriage_id, id) == 0) {
-            struct carriage *temp = current;
-            previous->next = current->next;
-            current = current->next;
-            free(temp);
-            return head;
+void *run_print_worker(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&print_pool.lock);
+    while (!print_pool.is_stopping) {
+        if (print_pool.next_job < print_pool.num_jobs) {
+            do_print_jobs();
         } else {
-            previous = current;
-            current = current->next;
+            pthread_cond_wait(&print_pool.has_jobs, &print_pool.lock);
         }
-    }       
-    return head;
+    }
+    pthread_mutex_unlock(&print_pool.lock);
+    return NULL;
 }
 
-// Updates the selected train to the next available.
-// then reattaches the linked list, removing the selected train from the list.
-//
-// Parameters: 
-//      *selected   - struct *, node along the train linked list to remove.
-//
-// Returns:
-//      The new selected node of the train linked list.
+// Takes runs of trains from the pool and summarises them until none are 
+// left to take. Called with the pool's lock held, which is let go while 
+// each run is summarised.
 //
-struct train *arrange_trains(struct train *selected) {
-    struct train *temp = selected;
-    // updates the selected train to the next available
-    if (selected->previous != NULL) {
-        selected = selected->previous;
-        selected->next = temp->next;
-        if (selected->next != NULL) {
-            selected->next->previous = selected;
+void do_print_jobs(void) {
+    while (print_pool.next_job < print_pool.num_jobs) {
+        struct summary_job *job = &print_pool.jobs[print_pool.next_job];
+        print_pool.next_job++;
+        pthread_mutex_unlock(&print_pool.lock);
+        summarise_trains(job);
+        pthread_mutex_lock(&print_pool.lock);
+        print_pool.num_done++;
+        if (print_pool.num_done == print_pool.num_jobs) {
+            pthread_cond_signal(&print_pool.is_done);
         }
-    } 
-    else if (selected->next != NULL) {
-        selected = selected->next;
-        selected->previous = NULL;
-    } else {
-        selected = create_train();
     }
-    return selected;
 }
 
-// Frees all the carriage nodes in the train, as well as the train node itself
-//
-// Parameters: 
-//      *selected   - struct *, node along the train linked list to remove.
+// Stops the print workers, if they were started, and waits for them.
 //
-void remove_train(struct train *selected) {
-    struct carriage *current = selected->carriages;
-    struct carriage *temp;
+void stop_print_workers(void) {
+    pthread_mutex_lock(&print_pool.lock);
+    if (!print_pool.is_started) {
+        pthread_mutex_unlock(&print_pool.lock);
+        return;
+    }
+    print_pool.is_stopping = VALID;
+    pthread_cond_broadcast(&print_pool.has_jobs);
+    pthread_mutex_unlock(&print_pool.lock);
 
-    if (is_train_real(current)) {
-        while (current != NULL) {
-            temp = current;
-            current = current->next;
-            free(temp);
-        }
+    int worker = 0;
+    while (worker < print_pool.num_threads) {
+        pthread_join(print_pool.threads[worker], NULL);
+        worker++;
     }
-    free(selected);
+    print_pool.is_started = INVALID;
+    print_pool.is_stopping = INVALID;
 }
 
-// Loops to the head node, then removes all the train and carriage nodes.
+// Formats the summaries of one print worker's run of trains. The trains 
+// are only read, and their totals are cached at the roots of their trees.
 //
 // Parameters: 
-//      *selected   - struct *, node along the train linked list to remove.
+//      *job    - struct summary_job *, the run of trains to summarise
 //
-void remove_all(struct train *selected) {
-    struct train *position = selected;
-    // Cycle to first train in linked list.
-    position = head_train(position);
-    
-    // remove each train in the linked list.
-    struct train *temp;
-    while (position != NULL) {
-        temp = position;
-        position = position->next;
-        remove_train(temp);
+// Returns:
+//      NULL, as the summaries are left in the job.
+//
+void *summarise_trains(void *job) {
+    struct summary_job *run = job;
+    struct directory *directory = run->selected->directory;
+    int count = run->first;
+    while (count < run->end) {
+        struct train *position = directory->trains[count];
+        struct space total = train_totals(position);
+        run->length += format_train_summary(run->text + run->length, 
+            is_selected(run->selected, position), count, total.capacity, 
+            total.occupied, train_length(position->carriages));
+        count++;
     }
-    
+    return NULL;
 }
 
-// Takes in commands from the user to change the properties of the train. 
+// Cycles to the first train in the linked list
 //
 // Parameters: 
-//      *selected   - struct *, selected node along the train linked list 
+//      *selected   - struct *, some node along the train linked list.
+//
+// Returns:
+//      The head node of the train linked list.
+//
+struct train *head_train(struct train *selected) {
+    return selected->directory->trains[0];
+}
+
+// Removes the carriage from the train.
+//
+// Parameters: 
+//      *train  - struct *, train to remove the carriage from.
+//      id      - string of the carriage ID.
+//
+// Returns:
+//      VALID   - if the command was carried out
+//      INVALID - if not
+//
+int remove_carriage(struct train *train, char id[ID_SIZE]) {
+    // Error Testing if ID is in train.
+    struct carriage *to_remove = find_id(train, id);
+    if (to_remove == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", id);
+        return INVALID;
+    }
+    index_remove(&train->index, id);
+    unlink_carriage(train, to_remove);
+    pool_free_carriage(train->pool, to_remove);
+    return VALID;
+}
+
+// Takes the selected train out of the directory, then updates the selected 
+// train to the one before it, or the one after it if it was first. 
+// If it was the only train, a new empty train replaces it.
+//
+// Parameters: 
+//      *selected   - struct *, node along the train linked list to remove.
+//
+// Returns:
+//      The new selected node of the train linked list.
+//
+struct train *arrange_trains(struct train *selected) {
+    struct directory *directory = selected->directory;
+    int number = selected->number;
+    directory_remove(directory, number);
+    // updates the selected train to the next available
+    if (number > 0) {
+        selected = directory->trains[number - 1];
+    } 
+    else if (directory->count > 0) {
+        selected = directory->trains[0];
+    } else {
+        selected = create_train(selected->pool);
+        directory_insert(directory, 0, selected);
+    }
+    return selected;
+}
+
+// Frees all the carriage nodes in the train, as well as the train node itself.
+// The carriages are handed back to the pool as one tree.
+//
+// Parameters: 
+//      *selected   - struct *, node along the train linked list to remove.
+//
+void remove_train(struct train *selected) {
+    pool_free_carriages(selected->pool, selected->carriages);
+    index_free(&selected->index);
+    pool_free_train(selected->pool, selected);
+}
+
+// Removes all the train and carriage nodes in the selected train's 
+// directory, leaving the directory empty.
+//
+// Parameters: 
+//      *selected   - struct *, node along the train linked list to remove.
+//
+void remove_all(struct train *selected) {
+    struct directory *directory = selected->directory;
+    // remove each train in the directory.
+    int number = 0;
+    while (number < directory->count) {
+        remove_train(directory->trains[number]);
+        number++;
+    }
+    directory->count = 0;
+}
+
+// Carries out the commands from the user to change the properties of the 
+// train. The arguments of the command have already been scanned in.
+//
+// Parameters: 
+//      *selected   - struct *, selected node along the train linked list 
+//      *command    - struct *, command given by the user
+//
+// Returns:
+//      The node to the current train in the train linked list. 
+//
+struct train *command_page(struct train *selected, struct command *command) {
+    // commands that change the network set this when they work
+    int is_applied = INVALID;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // prints help message
+    if (command->code == HELP) {
+        print_usage();
+    }
+    // adds carriage to the start
+    else if (command->code == ADD) {
+        int end_position = 0;
+        if (is_train_real(selected->carriages)) {
+            // sets the insertion point at the end of the linked list
+            end_position = train_length(selected->carriages);
+        }
+        is_applied = add_carriage(selected, end_position, command);
+    }
+    // prints current train
+    else if (command->code == PRINT) {
+        print_train(selected->carriages);
+    }
+    // prints a page of the current train's carriages
+    else if (command->code == PRINT_RANGE) {
+        print_carriage_range(selected->carriages, command->n, 
+                             command->other_n);
+    }
+    // adds carriage anywhere in the linked list
+    else if (command->code == INSERT) {
+        is_applied = add_carriage(selected, command->n, command);
+    }
+    // add passengers to the carriage
+    else if (command->code == SEAT) {
+        is_applied = is_loading_valid(selected, command);
+    }
+    // remove passengers from the carriage
+    else if (command->code == DISEMBARK) {
+        is_applied = is_loading_valid(selected, command);
+    }
+    // seats or removes passengers for a list of carriages
+    else if (command->code == BULK_SEAT || command->code == BULK_DISEMBARK) {
+        is_applied = load_carriages(selected, command);
+    }
+    // counts the total occupants and spare seats in the train.
+    else if (command->code == TOTAL) {
+        struct space total = train_totals(selected);
+        print_out("Total occupancy: %d\n", total.occupied);
+        print_out("Unoccupied capacity: %d\n", total.unoccupied);
+    }
+    // counts the total occupants and spare seats in a section of the train
+    else if (command->code == COUNT) {
+        count_passengers(selected, command->id, command->other_id, 
+                         command->code);
+    }
+    // moves passengers from one train to the next
+    else if (command->code == MOVE) {
+        is_applied = is_move_valid(selected, command);
+    }
+    // creates a new train
+    else if (command->code == NEW) {
+        struct train *new = create_train(selected->pool);
+        // the new train goes just before the currently selected train
+        directory_insert(selected->directory, selected->number, new);
+        is_applied = VALID;
+    }
+    // cycles to the proceeding train
+    else if (command->code == NEXT) {
+        struct train *next = train_at(selected->directory, 
+                                      selected->number + 1);
+        if (next != NULL) {
+            selected = next;
+            is_applied = VALID;
+        }
+    }
+    // cycles to the preceeding train
+    else if (command->code == PREVIOUS) {
+        struct train *previous = train_at(selected->directory, 
+                                          selected->number - 1);
+        if (previous != NULL) {
+            selected = previous;
+            is_applied = VALID;
+        }
+    }
+    // jumps straight to the train with the given number
+    else if (command->code == SELECT) {
+        struct train *train = train_at(selected->directory, command->n);
+        if (train == NULL) {
+            print_out("ERROR: No train exists with number: %d\n", 
+                      command->n);
+        } else {
+            selected = train;
+            is_applied = VALID;
+        }
+    }
+    // prints all the trains
+    else if (command->code == PRINT_ALL) {
+        print_all(selected);
+    }
+    // saves every train to a snapshot file
+    else if (command->code == SAVE) {
+        if (save_network(selected, command->path)) {
+            // the journal now only needs what happens after the snapshot
+            journal_checkpoint(command->path);
+            print_confirmation("Network saved to '%s'\n", command->path);
+        } else {
+            print_out("ERROR: Cannot save network to '%s'\n", command->path);
+        }
+    }
+    // replaces every train with the ones in a snapshot file
+    else if (command->code == LOAD) {
+        long length = 0;
+        char *data = map_snapshot(command->path, &length);
+        struct train *loaded = NULL;
+        if (data != NULL) {
+            loaded = load_network(selected, data, length);
+            // the journal keeps the snapshot itself rather than its path, 
+            // as the file can change after this
+            if (loaded != NULL) {
+                journal_snapshot(data, length);
+            }
+            munmap(data, length);
+        }
+        if (loaded == NULL) {
+            print_out("ERROR: Cannot load network from '%s'\n", 
+                      command->path);
+        } else {
+            selected = loaded;
+            print_confirmation("Network loaded from '%s'\n", command->path);
+        }
+    }
+    // prints a page of the trains
+    else if (command->code == PRINT_TRAINS) {
+        if (!is_non_neg(command->n)) {
+            print_out("ERROR: k must be at least 0\n");
+        } 
+        else if (!is_pos(command->other_n)) {
+            print_out("ERROR: n must be a positive integer\n");
+        }
+        else if (command->n >= selected->directory->count) {
+            print_out("ERROR: No train exists with number: %d\n",
+                      command->n);
+        } else {
+            print_trains(selected, command->n, command->other_n);
+        }
+    }
+    // removes a carriage from the selected train
+    else if (command->code == REMOVE) {
+        is_applied = remove_carriage(selected, command->id);
+    }
+    // removes the entire train
+    else if (command->code == REMOVE_TRAIN) {
+        struct train *temp = selected;
+        // arranges the trains next/previous links and updates selected
+        selected = arrange_trains(selected);
+        // removes the previouslly selected train.
+        remove_train(temp);
+        is_applied = VALID;
+    }
+    // Merges current and next train together
+    else if (command->code == MERGE) {
+        if (train_at(selected->directory, selected->number + 1) != NULL) {
+            merge_trains(selected);
+            is_applied = VALID;
+        }
+    }
+    // Splits trains into parts at the given carriage ID's.
+    else if (command->code == SPLIT) {
+        is_applied = split_trains(selected, command);
+    }
+    // prints the happiness of the passengers in a carriage
+    else if (command->code == HAPPINESS) {
+        print_carriage_happiness(selected, command->id);
+    }
+    // prints the average happiness of the passengers on the train
+    else if (command->code == AVERAGE_HAPPINESS) {
+        print_train_happiness(selected);
+    }
+    // rearranges the passengers on the train to make them happiest
+    else if (command->code == OPTIMISE) {
+        is_applied = optimise_happiness(selected);
+    }
+    // prints what the commands so far have cost
+    else if (command->code == STATS) {
+        print_stats(&stats);
+    }
+
+    if (is_applied) {
+        journal_command(command);
+    }
+    record_command(command->code, elapsed_ns(&start));
+    return selected;
+}
+
+// Merges the double carriage ID's into the first train and deletes them
+// from the 2nd train, in one pass over the 2nd train that looks each ID up
+// in the first train's index. The remaining carriages of the 2nd train are 
+// added to the first train's index and rebuilt into a tree in linear time.
+//
+// Parameters: 
+//      *selected       - struct *, the train to keep
+//      *next_train     - struct *, the train to delete.
+//
+// Returns:
+//      The root of the remaining carriages of the train to delete. 
+//
+struct carriage *merge_dupes(struct train *selected, 
+                             struct train *next_train) {
+    // lists the carriages in order before any of them are freed
+    int length = subtree_size(next_train->carriages);
+    struct carriage **carriages = allocate(length * sizeof(struct carriage *));
+    struct carriage *current = find_start(next_train->carriages);
+    int i = 0;
+    while (current != NULL) {
+        carriages[i] = current;
+        current = next_carriage(current);
+        i++;
+    }
+
+    // the carriages kept are moved to the front of the list
+    int num_kept = 0;
+    int num_dupes = 0;
+    i = 0;
+    while (i < length) {
+        current = carriages[i];
+        struct carriage *to_fix = find_id(selected, current->carriage_id);
+        if (to_fix != NULL) {
+            // add passengers of the duplicate to the current train, its
+            // totals are fixed once all the duplicates are found.
+            to_fix->capacity += current->capacity;
+            to_fix->occupancy += current->occupancy;
+            pool_free_carriage(selected->pool, current);
+            num_dupes++;
+        } else {
+            index_insert(&selected->index, current);
+            carriages[num_kept] = current;
+            num_kept++;
+        }
+        i++;
+    }
+    if (num_dupes > 0) {
+        update_all_totals(selected->carriages);
+    }
+
+    struct carriage *root = build_carriages(carriages, num_kept);
+    deallocate(carriages);
+    return root;
+}
+
+// Merges 2 trains (carriages linked lists) into one.
+// Then deletes the second train node. 
+//
+// Parameters: 
+//      *selected   - struct *, selected node along the train linked list 
+//
+void merge_trains(struct train *selected) {
+    struct carriage *current = selected->carriages;
+    struct train *next_train = train_at(selected->directory, 
+                                        selected->number + 1);
+    struct carriage *next_carriage = next_train->carriages;
+
+    // connect 2nd train to the end of the first if both exist
+    if (is_train_real(current)) {
+        if (is_train_real(next_carriage)) {
+            // removes duplicates from 2nd train first. 
+            next_carriage = merge_dupes(selected, next_train);
+            set_carriages(selected, join_carriages(current, next_carriage));
+        }
+        index_free(&next_train->index);
+
+    } else {
+        // if no carriages in first, moves the carriages of the 2nd train 
+        // and its index to the first train instead.
+        selected->carriages = next_carriage;
+        index_free(&selected->index);
+        selected->index = next_train->index;
+    }
+
+    // remove 2nd train from the directory
+    directory_remove(selected->directory, next_train->number);
+    pool_free_train(selected->pool, next_train);
+}
+
+// If the inputs are valid, splits the train into multiple parts.
+// Every ID is looked up in the selected train's index first, then the train
+// is cut at all of the found positions at once. Cutting twice at the same
+// carriage leaves an empty train between the two cuts.
+//
+// Parameters: 
+//      *start      - struct *, selected node along the train linked list 
+//      *command    - struct *, command given by the user, with the IDs
+//
+// Returns:
+//      VALID   - if the train was split at least once
+//      INVALID - if not
+//
+int split_trains(struct train *start, struct command *command) {
+    int num_splits = command->n;
+    int num_cuts = 0;
+
+    if (!is_pos(num_splits)) {
+        print_out("ERROR: n must be a positive integer\n");
+    } else {
+        // positions of the carriages to split at, in the original train
+        int *cuts = allocate(num_splits * sizeof(int));
+        int split = 0;
+        while (split < num_splits) {
+            char *id = command->ids[split];
+            struct carriage *split_at = find_id(start, id);
+            if (split_at == NULL) {
+                print_out("No carriage exists with id: '%s'. Skipping\n", id);
+            } else {
+                cuts[num_cuts] = carriage_position(split_at);
+                num_cuts++;
+            }
+            split++;
+        }
+
+        qsort(cuts, num_cuts, sizeof(int), compare_positions);
+        cut_train(start, cuts, num_cuts);
+        deallocate(cuts);
+    }
+    return validity(num_cuts > 0);
+}
+
+// Compares two carriage positions for qsort.
+//
+// Parameters:
+//      *a  - const void *, pointer to the first position
+//      *b  - const void *, pointer to the second position
+//
+// Returns:
+//      Negative if a is first, positive if b is first, 0 if the same.
+//
+int compare_positions(const void *a, const void *b) {
+    int first = *(const int *)a;
+    int second = *(const int *)b;
+    return (first > second) - (first < second);
+}
+
+// Cuts a train at each of the given positions. The carriages from each
+// position up to the next go into a new train, and the new trains follow
+// the selected train in order. The biggest part keeps the train's index,
+// and only the carriages of the other parts are moved to new indexes.
+//
+// Parameters: 
+//      *selected   - struct *, selected node along the train linked list 
+//      cuts[]      - int array, positions to cut at, in increasing order
+//      num_cuts    - int, number of positions
+//
+void cut_train(struct train *selected, int cuts[], int num_cuts) {
+    if (num_cuts == 0) {
+        return;
+    }
+    // cuts the tree from the back, so the earlier positions don't change.
+    struct carriage **parts = allocate((num_cuts + 1) 
+                                       * sizeof(struct carriage *));
+    struct carriage *rest = selected->carriages;
+    int part = num_cuts;
+    while (part > 0) {
+        split_carriages(rest, cuts[part - 1], &rest, &parts[part]);
+        part--;
+    }
+    parts[0] = rest;
+
+    // creates a train after the last for each part after the first
+    struct directory *directory = selected->directory;
+    struct train *biggest = selected;
+    set_carriages(selected, parts[0]);
+    part = 1;
+    while (part <= num_cuts) {
+        struct train *new = create_train(selected->pool);
+        directory_insert(directory, selected->number + part, new);
+        set_carriages(new, parts[part]);
+        if (subtree_size(parts[part]) > subtree_size(biggest->carriages)) {
+            biggest = new;
+        }
+        part++;
+    }
+    deallocate(parts);
+
+    // gives the biggest part the index, then moves the other parts' entries
+    struct id_index temp = selected->index;
+    selected->index = biggest->index;
+    biggest->index = temp;
+    part = 0;
+    while (part <= num_cuts) {
+        struct train *current = directory->trains[selected->number + part];
+        if (current != biggest) {
+            struct carriage *carriage = find_start(current->carriages);
+            while (carriage != NULL) {
+                index_remove(&biggest->index, carriage->carriage_id);
+                index_insert(&current->index, carriage);
+                carriage = next_carriage(carriage);
+            }
+        }
+        part++;
+    }
+}
+
+// Saves every train and carriage, and which train is selected, to a 
+// snapshot file. The snapshot is written to a temporary file, synced, 
+// and renamed over the old one, so a crash leaves one snapshot or the other.
+//
+// Parameters:
+//      *selected   - struct *, the selected train
+//      *path       - string, file to save to
+//
+// Returns:
+//      VALID   - if the whole snapshot was written
+//      INVALID - if not, the old file is left as it was
+//
+int save_network(struct train *selected, char *path) {
+    char temp_path[PATH_SIZE + sizeof(TEMP_SUFFIX)];
+    strcpy(temp_path, path);
+    strcat(temp_path, TEMP_SUFFIX);
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        return INVALID;
+    }
+    struct directory *directory = selected->directory;
+    struct snapshot_header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_trains = directory->count;
+    header.selected = selected->number;
+    fwrite(&header, sizeof(header), 1, file);
+
+    int number = 0;
+    while (number < directory->count) {
+        struct train *train = directory->trains[number];
+        unsigned int num_carriages = train_length(train->carriages);
+        fwrite(&num_carriages, sizeof(num_carriages), 1, file);
+
+        struct carriage *current = find_start(train->carriages);
+        while (current != NULL) {
+            struct carriage_record record;
+            memset(&record, 0, sizeof(record));
+            strcpy(record.carriage_id, current->carriage_id);
+            record.type = current->type;
+            record.capacity = current->capacity;
+            record.occupancy = current->occupancy;
+            fwrite(&record, sizeof(record), 1, file);
+            current = next_carriage(current);
+        }
+        number++;
+    }
+
+    int is_written = fflush(file) == 0 && !ferror(file) 
+                     && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0) {
+        is_written = INVALID;
+    }
+    if (!is_written || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return INVALID;
+    }
+    sync_directory(path);
+    return VALID;
+}
+
+// Maps a snapshot file into memory to be read in one pass.
+//
+// Parameters:
+//      *path       - string, the snapshot file
+//      *length     - long *, set to the number of bytes in the file
+//
+// Returns:
+//      The mapped file, to be unmapped with munmap, or NULL if it can't be
+//      read or is too short to be a snapshot.
+//
+char *map_snapshot(char *path, long *length) {
+    int fd = open(path, O_RDONLY);
+    struct stat file_info;
+    if (fd < 0 || fstat(fd, &file_info) < 0 
+        || file_info.st_size < (long)sizeof(struct snapshot_header)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *data = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(data, file_info.st_size, MADV_SEQUENTIAL);
+    *length = file_info.st_size;
+    return data;
+}
+
+// Replaces every train with the trains in a snapshot, building each 
+// train's tree from it in one pass. If it isn't a valid snapshot, nothing 
+// changes.
+//
+// Parameters:
+//      *selected   - struct *, the selected train
+//      *data       - char *, the snapshot
+//      length      - long, number of bytes in the snapshot
+//
+// Returns:
+//      The new selected train, or NULL if the snapshot couldn't be loaded.
+//
+struct train *load_network(struct train *selected, char *data, long length) {
+    if (length < (long)sizeof(struct snapshot_header)) {
+        return NULL;
+    }
+    int selected_number;
+    struct directory *loaded = read_snapshot(selected->pool, data, length, 
+                                             &selected_number);
+    if (loaded == NULL) {
+        return NULL;
+    }
+
+    // moves the loaded trains into the network's own directory
+    struct directory *directory = selected->directory;
+    remove_all(selected);
+    int number = 0;
+    while (number < loaded->count) {
+        directory_insert(directory, number, loaded->trains[number]);
+        number++;
+    }
+    free_directory(loaded);
+    return directory->trains[selected_number];
+}
+
+// Reads the trains out of a snapshot in memory into a new directory.
+//
+// Parameters:
+//      *pool               - struct *, pool to allocate the trains from
+//      *data               - char *, the snapshot
+//      length              - long, number of bytes in the snapshot
+//      *selected_number    - int *, set to the number of the selected train
+//
+// Returns:
+//      The directory of trains, or NULL if the snapshot isn't valid.
+//
+struct directory *read_snapshot(struct pool *pool, char *data, long length,
+                                int *selected_number) {
+    struct snapshot_header header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SNAPSHOT_VERSION || header.num_trains == 0 
+        || header.selected >= header.num_trains) {
+        return NULL;
+    }
+    *selected_number = header.selected;
+
+    struct directory *directory = create_directory();
+    long position = sizeof(header);
+    int is_valid = VALID;
+    while (is_valid && directory->count < (int)header.num_trains) {
+        // every train is length prefixed
+        unsigned int num_carriages = 0;
+        if (length - position < (long)sizeof(num_carriages)) {
+            is_valid = INVALID;
+        } else {
+            memcpy(&num_carriages, data + position, sizeof(num_carriages));
+            position += sizeof(num_carriages);
+            if ((length - position) / (long)sizeof(struct carriage_record) 
+                < num_carriages) {
+                is_valid = INVALID;
+            }
+        }
+
+        if (is_valid) {
+            struct train *train = create_train(pool);
+            directory_insert(directory, directory->count, train);
+            is_valid = read_train(train, data + position, num_carriages);
+            position += num_carriages * sizeof(struct carriage_record);
+        }
+    }
+
+    if (!is_valid || position != length) {
+        if (directory->count > 0) {
+            remove_all(directory->trains[0]);
+        }
+        free_directory(directory);
+        return NULL;
+    }
+    return directory;
+}
+
+// Creates a train's carriages from their records in a snapshot, then 
+// builds them into the train's tree in linear time.
+//
+// Parameters:
+//      *train          - struct *, empty train to fill
+//      *data           - char *, the train's carriage records
+//      num_carriages   - int, number of records
+//
+// Returns:
+//      VALID   - if every record was a valid carriage with a new ID
+//      INVALID - if not, the train then holds the carriages read so far
+//
+int read_train(struct train *train, char *data, int num_carriages) {
+    struct carriage **carriages = allocate(num_carriages 
+                                           * sizeof(struct carriage *));
+    int num_read = 0;
+    int is_valid = VALID;
+    while (is_valid && num_read < num_carriages) {
+        struct carriage_record record;
+        memcpy(&record, data + num_read * sizeof(record), sizeof(record));
+        if (record.carriage_id[0] == '\0' 
+            || record.carriage_id[ID_SIZE - 1] != '\0'
+            || !is_type_valid(record.type) 
+            || !is_capacity_valid(record.capacity)
+            || record.occupancy < 0 || record.occupancy > record.capacity
+            || find_id(train, record.carriage_id) != NULL) {
+            is_valid = INVALID;
+        } else {
+            struct carriage *new = create_carriage(train->pool, 
+                record.carriage_id, record.type, record.capacity);
+            new->occupancy = record.occupancy;
+            index_insert(&train->index, new);
+            carriages[num_read] = new;
+            num_read++;
+        }
+    }
+    set_carriages(train, build_carriages(carriages, num_read));
+    deallocate(carriages);
+    return is_valid;
+}
+
+// Opens the journal file, starting it with a header if it is new. 
+// Nothing is recorded until the journal has been replayed.
+//
+// Parameters:
+//      *path   - string, the journal file
+//
+// Returns:
+//      VALID   - if the file is a journal, or was empty
+//      INVALID - if not
+//
+int open_journal(char *path) {
+    journal.is_open = INVALID;
+    journal.num_networks = 1;
+    journal.length = 0;
+    journal.buffer = NULL;
+    journal.path = path;
+    journal.fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat file_info;
+    if (journal.fd < 0 || fstat(journal.fd, &file_info) < 0) {
+        return INVALID;
+    }
+
+    struct journal_header header;
+    int is_valid = VALID;
+    if (file_info.st_size == 0) {
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.version = JOURNAL_VERSION;
+        is_valid = validity(write(journal.fd, &header, sizeof(header)) 
+                            == sizeof(header));
+    } else if (read(journal.fd, &header, sizeof(header)) != sizeof(header)
+               || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic))
+               || header.version != JOURNAL_VERSION) {
+        is_valid = INVALID;
+    }
+    if (!is_valid) {
+        close(journal.fd);
+        return INVALID;
+    }
+    journal.buffer = allocate(JOURNAL_BUFFER_SIZE);
+    return VALID;
+}
+
+// Recovers the network by carrying out every command in the journal again, 
+// with the output muted. A record cut short by a crash is dropped from the 
+// end of the file, and new commands are recorded after the last whole one.
+// If a snapshot the journal holds isn't valid, the network can't be 
+// recovered, so the journal is closed untouched.
+//
+// Parameters:
+//      *networks   - struct *, the new networks to carry the commands out on
+//
+// Returns:
+//      VALID   - if the whole journal was carried out
+//      INVALID - if a snapshot couldn't be loaded
+//
+int replay_journal(struct network_list *networks) {
+    struct stat file_info;
+    fstat(journal.fd, &file_info);
+    long length = file_info.st_size;
+    char *data = NULL;
+    if (length > (long)sizeof(struct journal_header)) {
+        data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else {
+            madvise(data, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    struct command command;
+    command.ids = NULL;
+    command.loads = NULL;
+    command.ids_size = 0;
+    long position = sizeof(struct journal_header);
+    int num_replayed = 0;
+    int is_recovered = VALID;
+    flush_output();
+    sink.is_muted = VALID;
+    while (is_recovered && data != NULL 
+           && read_record(data, length, &position, &command)) {
+        if (command.code == LOAD) {
+            is_recovered = replay_load(networks->current, command.snapshot,
+                                       command.snapshot_length);
+        } else {
+            run_command(networks, &command);
+        }
+        num_replayed++;
+    }
+    flush_output();
+    sink.is_muted = INVALID;
+    deallocate(command.ids);
+    deallocate(command.loads);
+    if (data != NULL) {
+        munmap(data, length);
+    }
+    if (!is_recovered) {
+        fprintf(stderr, "ERROR: Cannot load a snapshot in the journal\n");
+        close(journal.fd);
+        deallocate(journal.buffer);
+        return INVALID;
+    }
+
+    if (position < length) {
+        if (ftruncate(journal.fd, position) < 0) {
+            fprintf(stderr, "ERROR: Cannot drop the end of the journal\n");
+        }
+    }
+    lseek(journal.fd, 0, SEEK_END);
+    journal.is_open = VALID;
+    journal.num_networks = networks->count;
+    if (num_replayed > 0) {
+        print_confirmation("Recovered %d commands from the journal\n", 
+                           num_replayed);
+    }
+    return VALID;
+}
+
+// Loads a snapshot the journal holds, selecting the loaded train.
+//
+// Parameters:
+//      *network    - struct *, the network to load the snapshot into
+//      *data       - char *, the snapshot, in the journal
+//      length      - long, number of bytes in the snapshot
+//
+// Returns:
+//      VALID   - if the snapshot was loaded
+//      INVALID - if not, the network is unchanged
+//
+int replay_load(struct network *network, char *data, long length) {
+    struct train *loaded = load_network(network->selected, data, length);
+    if (loaded == NULL) {
+        return INVALID;
+    }
+    network->selected = loaded;
+    return VALID;
+}
+
+// Decodes the next record of the journal into a command.
+//
+// Parameters:
+//      *data       - char *, the journal
+//      length      - long, number of bytes in the journal
+//      *position   - long *, where the record starts, moved past it
+//      *command    - struct *, filled in with the command
+//
+// Returns:
+//      VALID   - if a whole record was read
+//      INVALID - at the end of the journal, or if the record is cut short
+//
+int read_record(char *data, long length, long *position, 
+                struct command *command) {
+    long start = *position;
+    char code;
+    if (!read_bytes(data, length, position, &code, 1)) {
+        return INVALID;
+    }
+    command->code = code;
+
+    int is_valid = VALID;
+    if (code == ADD || code == INSERT) {
+        unsigned char type = 0;
+        if (code == INSERT) {
+            is_valid = read_bytes(data, length, position, &command->n, 
+                                  sizeof(int));
+        }
+        is_valid = is_valid 
+                   && read_bytes(data, length, position, command->id, ID_SIZE)
+                   && read_bytes(data, length, position, &type, 1)
+                   && read_bytes(data, length, position, &command->capacity,
+                                 sizeof(int));
+        command->type = type;
+    }
+    else if (code == SEAT || code == DISEMBARK) {
+        is_valid = read_bytes(data, length, position, command->id, ID_SIZE)
+                   && read_bytes(data, length, position, &command->n, 
+                                 sizeof(int));
+    }
+    else if (code == MOVE) {
+        is_valid = read_bytes(data, length, position, command->id, ID_SIZE)
+                   && read_bytes(data, length, position, command->other_id, 
+                                 ID_SIZE)
+                   && read_bytes(data, length, position, &command->n, 
+                                 sizeof(int));
+    }
+    else if (code == REMOVE) {
+        is_valid = read_bytes(data, length, position, command->id, ID_SIZE);
+    }
+    else if (code == SELECT || code == SWITCH_NETWORK) {
+        is_valid = read_bytes(data, length, position, &command->n, 
+                              sizeof(int));
+    }
+    else if (code == SPLIT || code == BULK_SEAT || code == BULK_DISEMBARK) {
+        int item_size = ID_SIZE;
+        if (code != SPLIT) {
+            item_size += sizeof(int);
+        }
+        is_valid = read_bytes(data, length, position, &command->n, 
+                              sizeof(int))
+                   && command->n > 0 
+                   && command->n <= (length - *position) / item_size;
+        int item = 0;
+        if (is_valid) {
+            reserve_ids(command, command->n);
+            read_bytes(data, length, position, command->ids, 
+                       command->n * ID_SIZE);
+            if (code != SPLIT) {
+                read_bytes(data, length, position, command->loads, 
+                           command->n * sizeof(int));
+            }
+        }
+        while (is_valid && item < command->n) {
+            is_valid = validity(memchr(command->ids[item], '\0', 
+                                       ID_SIZE) != NULL);
+            item++;
+        }
+    }
+    else if (code == LOAD) {
+        // the snapshot is left where it is in the journal
+        long long snapshot_length = 0;
+        is_valid = read_bytes(data, length, position, &snapshot_length, 
+                              sizeof(snapshot_length))
+                   && snapshot_length >= 0 
+                   && snapshot_length <= length - *position;
+        if (is_valid) {
+            command->snapshot = data + *position;
+            command->snapshot_length = snapshot_length;
+            *position += snapshot_length;
+        }
+    }
+    else if (code != NEW && code != NEXT && code != PREVIOUS 
+             && code != REMOVE_TRAIN && code != MERGE && code != OPTIMISE
+             && code != NEW_NETWORK && code != DROP_NETWORK) {
+        is_valid = INVALID;
+    }
+
+    // IDs have to be strings, or the record was not written by us
+    if (is_valid && (code == ADD || code == INSERT || code == SEAT 
+                     || code == DISEMBARK || code == MOVE || code == REMOVE)) {
+        is_valid = validity(memchr(command->id, '\0', ID_SIZE) != NULL);
+    }
+    if (is_valid && code == MOVE) {
+        is_valid = validity(memchr(command->other_id, '\0', ID_SIZE) 
+                            != NULL);
+    }
+    if (!is_valid) {
+        *position = start;
+    }
+    return is_valid;
+}
+
+// Copies the next bytes of the journal, if there are enough left.
+//
+// Parameters:
+//      *data       - char *, the journal
+//      length      - long, number of bytes in the journal
+//      *position   - long *, where to copy from, moved past the bytes
+//      *to         - void *, where to copy to
+//      size        - int, number of bytes to copy
+//
+// Returns:
+//      VALID   - if the bytes were copied
+//      INVALID - if the journal ends first
+//
+int read_bytes(char *data, long length, long *position, void *to, int size) {
+    if (length - *position < size) {
+        return INVALID;
+    }
+    memcpy(to, data + *position, size);
+    *position += size;
+    return VALID;
+}
+
+// Records a command that changed the network at the end of the journal.
+//
+// Parameters:
+//      *command    - struct *, the command that was carried out
+//
+void journal_command(struct command *command) {
+    if (!journal.is_open) {
+        return;
+    }
+    char code = command->code;
+    journal_put(&code, 1);
+    if (code == ADD || code == INSERT) {
+        unsigned char type = command->type;
+        if (code == INSERT) {
+            journal_put(&command->n, sizeof(int));
+        }
+        journal_put(command->id, ID_SIZE);
+        journal_put(&type, 1);
+        journal_put(&command->capacity, sizeof(int));
+    }
+    else if (code == SEAT || code == DISEMBARK) {
+        journal_put(command->id, ID_SIZE);
+        journal_put(&command->n, sizeof(int));
+    }
+    else if (code == MOVE) {
+        journal_put(command->id, ID_SIZE);
+        journal_put(command->other_id, ID_SIZE);
+        journal_put(&command->n, sizeof(int));
+    }
+    else if (code == REMOVE) {
+        journal_put(command->id, ID_SIZE);
+    }
+    else if (code == SELECT || code == SWITCH_NETWORK) {
+        journal_put(&command->n, sizeof(int));
+    }
+    else if (code == SPLIT) {
+        journal_put(&command->n, sizeof(int));
+        journal_put(command->ids, command->n * ID_SIZE);
+    }
+    else if (code == BULK_SEAT || code == BULK_DISEMBARK) {
+        journal_put(&command->n, sizeof(int));
+        journal_put(command->ids, command->n * ID_SIZE);
+        journal_put(command->loads, command->n * sizeof(int));
+    }
+}
+
+// Records a snapshot that was loaded at the end of the journal. The whole 
+// snapshot is kept, so recovery doesn't depend on a file that may have 
+// been changed or moved since.
+//
+// Parameters:
+//      *data   - char *, the snapshot
+//      length  - long, number of bytes in the snapshot
+//
+void journal_snapshot(char *data, long length) {
+    if (!journal.is_open) {
+        return;
+    }
+    char code = LOAD;
+    long long snapshot_length = length;
+    journal_put(&code, 1);
+    journal_put(&snapshot_length, sizeof(snapshot_length));
+    while (length > 0) {
+        int part = JOURNAL_BUFFER_SIZE;
+        if (length < part) {
+            part = length;
+        }
+        journal_put(data, part);
+        data += part;
+        length -= part;
+    }
+}
+
+// Adds bytes to the journal's buffer, writing the buffer out first if it 
+// is too full.
+//
+// Parameters:
+//      *data   - void *, bytes to add
+//      length  - int, number of bytes to add
+//
+void journal_put(void *data, int length) {
+    if (journal.length + length > JOURNAL_BUFFER_SIZE) {
+        flush_journal();
+    }
+    if (length > JOURNAL_BUFFER_SIZE) {
+        write_journal(data, length);
+        return;
+    }
+    memcpy(journal.buffer + journal.length, data, length);
+    journal.length += length;
+}
+
+// Starts the journal again from a snapshot that was just saved. Everything 
+// recorded so far is in the snapshot, so a new journal holding just the 
+// snapshot is written beside the old one, synced, and renamed over it. A crash at any point leaves one whole journal or the other. 
+// With more than one network the snapshot doesn't hold them all, so the 
+// journal carries on as it is.
+//
+// Parameters:
+//      *path   - string, the snapshot file
+//
+void journal_checkpoint(char *path) {
+    if (!journal.is_open || journal.num_networks > 1) {
+        return;
+    }
+    // the old journal stays whole until the new one replaces it
+    flush_journal();
+    long length = 0;
+    char *data = map_snapshot(path, &length);
+    if (data == NULL) {
+        return;
+    }
+    char *temp_path = allocate(strlen(journal.path) 
+                               + sizeof(TEMP_SUFFIX));
+    strcpy(temp_path, journal.path);
+    strcat(temp_path, TEMP_SUFFIX);
+    int old_fd = journal.fd;
+    journal.fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (journal.fd < 0) {
+        journal.fd = old_fd;
+        deallocate(temp_path);
+        munmap(data, length);
+        return;
+    }
+
+    struct journal_header header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    journal_put(&header, sizeof(header));
+    journal_snapshot(data, length);
+    munmap(data, length);
+    flush_journal();
+    // a large snapshot is written in parts, so the size shows it all went
+    struct stat file_info;
+    int is_written = validity(fstat(journal.fd, &file_info) == 0 
+        && file_info.st_size == (long)(sizeof(header) + 1 
+                                       + sizeof(long long) + length));
+
+    if (is_written && fsync(journal.fd) == 0 
+        && rename(temp_path, journal.path) == 0) {
+        close(old_fd);
+        sync_directory(journal.path);
+    } else {
+        close(journal.fd);
+        unlink(temp_path);
+        journal.fd = old_fd;
+    }
+    deallocate(temp_path);
+}
+
+// Makes sure the entry for a file that was just renamed is on disk.
+//
+// Parameters:
+//      *path   - string, the file
+//
+void sync_directory(char *path) {
+    char *copy = allocate(strlen(path) + 1);
+    strcpy(copy, path);
+    int fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    deallocate(copy);
+}
+
+// Writes out every record in the journal's buffer.
+//
+void flush_journal(void) {
+    if (journal.is_open) {
+        write_journal(journal.buffer, journal.length);
+    }
+    journal.length = 0;
+}
+
+// Writes bytes straight to the journal file, bypassing the buffer.
+//
+// Parameters:
+//      *data   - char *, bytes to write
+//      length  - int, number of bytes to write
+//
+// Returns:
+//      VALID   - if every byte was written
+//      INVALID - if not
+//
+int write_journal(char *data, int length) {
+    int written = 0;
+    while (written < length) {
+        ssize_t bytes = write(journal.fd, data + written, length - written);
+        if (bytes <= 0) {
+            break;
+        }
+        written += bytes;
+    }
+    return validity(written == length);
+}
+
+// Writes out anything left in the journal and closes it.
+//
+void close_journal(void) {
+    if (!journal.is_open) {
+        return;
+    }
+    flush_journal();
+    close(journal.fd);
+    deallocate(journal.buffer);
+    journal.is_open = INVALID;
+}
+
+// Allocates a new, empty directory of trains.
+//
+// Returns:
+//      The new directory.
+//
+struct directory *create_directory(void) {
+    struct directory *directory = allocate(sizeof(struct directory));
+    directory->size = DIRECTORY_MIN_SIZE;
+    directory->trains = allocate(directory->size * sizeof(struct train *));
+    directory->count = 0;
+    pthread_rwlock_init(&directory->lock, NULL);
+    directory->num_desks = 0;
+    return directory;
+}
+
+// Puts a train into the directory at the given number. The trains from
+// that number on move up one, and are renumbered.
+//
+// Parameters:
+//      *directory  - struct *, the directory
+//      number      - int, the train's number, at most the number of trains
+//      *train      - struct *, train to put in
+//
+void directory_insert(struct directory *directory, int number, 
+                      struct train *train) {
+    if (directory->count == directory->size) {
+        directory->size *= 2;
+        directory->trains = reallocate(directory->trains, 
+                                       directory->size * sizeof(struct train *));
+    }
+    memmove(&directory->trains[number + 1], &directory->trains[number],
+            (directory->count - number) * sizeof(struct train *));
+    directory->trains[number] = train;
+    directory->count++;
+    train->directory = directory;
+
+    int i = number;
+    while (i < directory->count) {
+        directory->trains[i]->number = i;
+        i++;
+    }
+}
+
+// Takes the train with the given number out of the directory. The trains
+// after it move down one, and are renumbered. The train itself isn't freed.
+//
+// Parameters:
+//      *directory  - struct *, the directory
+//      number      - int, the train's number
+//
+void directory_remove(struct directory *directory, int number) {
+    directory->count--;
+    memmove(&directory->trains[number], &directory->trains[number + 1],
+            (directory->count - number) * sizeof(struct train *));
+
+    int i = number;
+    while (i < directory->count) {
+        directory->trains[i]->number = i;
+        i++;
+    }
+}
+
+// Finds a train by its number.
+//
+// Parameters:
+//      *directory  - struct *, the directory
+//      number      - int, the train's number
+//
+// Returns:
+//      The train, or NULL if no train has that number.
+//
+struct train *train_at(struct directory *directory, int number) {
+    if (number < 0 || number >= directory->count) {
+        return NULL;
+    }
+    return directory->trains[number];
+}
+
+// Frees the directory. The trains in it must already be freed.
+//
+// Parameters:
+//      *directory  - struct *, the directory
+//
+void free_directory(struct directory *directory) {
+    pthread_rwlock_destroy(&directory->lock);
+    deallocate(directory->trains);
+    deallocate(directory);
+}
+
+// Creates a network with one empty train, and its own pool so that each 
+// network's trains and carriages are kept together in memory.
+//
+// Parameters:
+//      number  - int, the network's number
+//
+// Returns:
+//      The new network.
+//
+struct network *create_network(int number) {
+    struct network *network = allocate(sizeof(struct network));
+    network->number = number;
+    // Pool all the trains and carriages are allocated from.
+    network->pool = create_pool();
+    // Directory of every train, in order.
+    network->directory = create_directory();
+    // All carriages are stored in the first train until we change trains.
+    network->selected = create_train(network->pool);
+    directory_insert(network->directory, 0, network->selected);
+    return network;
+}
+
+// Frees every train of a network, and the network itself.
+//
+// Parameters:
+//      *network    - struct *, network to free
+//
+void free_network(struct network *network) {
+    remove_all(network->selected);
+    free_directory(network->directory);
+    free_pool(network->pool);
+    deallocate(network);
+}
+
+// Creates a list holding one new network, which is the current network.
+//
+// Returns:
+//      The new list.
+//
+struct network_list *create_network_list(void) {
+    struct network_list *networks = allocate(sizeof(struct network_list));
+    networks->size = NETWORK_LIST_MIN_SIZE;
+    networks->networks = allocate(networks->size * sizeof(struct network *));
+    networks->networks[0] = create_network(0);
+    networks->count = 1;
+    networks->current = networks->networks[0];
+    return networks;
+}
+
+// Frees every network in a list, and the list itself.
+//
+// Parameters:
+//      *networks   - struct *, list to free
+//
+void free_network_list(struct network_list *networks) {
+    int number = 0;
+    while (number < networks->count) {
+        free_network(networks->networks[number]);
+        number++;
+    }
+    deallocate(networks->networks);
+    deallocate(networks);
+}
+
+// Carries out a command on the current network. The network commands 
+// themselves change which networks there are, or which one is current.
+//
+// Parameters:
+//      *networks   - struct *, every network of the command stream
+//      *command    - struct *, command given by the user
+//
+void run_command(struct network_list *networks, struct command *command) {
+    struct network *current = networks->current;
+    if (command->code != NEW_NETWORK && command->code != SWITCH_NETWORK 
+        && command->code != DROP_NETWORK) {
+        current->selected = command_page(current->selected, command);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int is_applied = VALID;
+    // adds an empty network to the end of the list, and switches to it
+    if (command->code == NEW_NETWORK) {
+        if (networks->count == networks->size) {
+            networks->size *= 2;
+            networks->networks = reallocate(networks->networks, 
+                networks->size * sizeof(struct network *));
+        }
+        current = create_network(networks->count);
+        networks->networks[networks->count] = current;
+        networks->count++;
+    }
+    // switches to the network with the given number
+    else if (command->code == SWITCH_NETWORK) {
+        if (command->n < 0 || command->n >= networks->count) {
+            print_out("ERROR: No network exists with number: %d\n", 
+                      command->n);
+            is_applied = INVALID;
+        } else {
+            current = networks->networks[command->n];
+        }
+    }
+    // drops the current network, switching to the one before it
+    else {
+        int number = current->number;
+        free_network(current);
+        networks->count--;
+        int moved = number;
+        while (moved < networks->count) {
+            networks->networks[moved] = networks->networks[moved + 1];
+            networks->networks[moved]->number = moved;
+            moved++;
+        }
+        if (networks->count == 0) {
+            networks->networks[0] = create_network(0);
+            networks->count = 1;
+        }
+        if (number > 0) {
+            number--;
+        }
+        current = networks->networks[number];
+    }
+
+    networks->current = current;
+    if (is_applied && journal.is_open) {
+        journal.num_networks = networks->count;
+        journal_command(command);
+    }
+    record_command(command->code, elapsed_ns(&start));
+}
+
+// Hashes a carriage ID using FNV-1a.
+//
+// Parameters:
+//      id[ID_SIZE] - string, which contains the carriage ID
+//
+// Returns:
+//      The hash of the ID.
+//
+unsigned int hash_id(char id[ID_SIZE]) {
+    unsigned int hash = 2166136261u;
+    int i = 0;
+    while (i < ID_SIZE && id[i] != '\0') {
+        hash ^= (unsigned char)id[i];
+        hash *= 16777619u;
+        i++;
+    }
+    return hash;
+}
+
+// Looks up a carriage ID in the index.
+//
+// Parameters:
+//      *index      - struct *, index to search
+//      id[ID_SIZE] - string, which contains the carriage ID
+//
+// Returns:
+//      The carriage with the ID, or NULL if it is not in the index.
+//
+struct carriage *index_find(struct id_index *index, char id[ID_SIZE]) {
+    if (index->size == 0) {
+        return NULL;
+    }
+    int mask = index->size - 1;
+    int slot = hash_id(id) & mask;
+    while (index->slots[slot] != NULL) {
+        stats.index_probes++;
+        if (strcmp(index->slots[slot]->carriage_id, id) == 0) {
+            return index->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+// Adds a carriage to the index, growing the table to keep it at most 
+// half full. The carriage's ID must not already be in the index.
+//
+// Parameters:
+//      *index      - struct *, index to add to
+//      *carriage   - struct *, carriage to add
+//
+void index_insert(struct id_index *index, struct carriage *carriage) {
+    if ((index->count + 1) * 2 > index->size) {
+        index_grow(index);
+    }
+    int mask = index->size - 1;
+    int slot = hash_id(carriage->carriage_id) & mask;
+    while (index->slots[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    index->slots[slot] = carriage;
+    index->count++;
+}
+
+// Removes a carriage ID from the index. Entries after the removed slot are
+// shifted back so that no probe sequence is broken.
+//
+// Parameters:
+//      *index      - struct *, index to remove from
+//      id[ID_SIZE] - string, which contains the carriage ID
+//
+void index_remove(struct id_index *index, char id[ID_SIZE]) {
+    if (index->size == 0) {
+        return;
+    }
+    int mask = index->size - 1;
+    int hole = hash_id(id) & mask;
+    while (index->slots[hole] != NULL 
+           && strcmp(index->slots[hole]->carriage_id, id) != 0) {
+        hole = (hole + 1) & mask;
+    }
+    if (index->slots[hole] == NULL) {
+        return;
+    }
+    index->slots[hole] = NULL;
+    index->count--;
+
+    int next = (hole + 1) & mask;
+    while (index->slots[next] != NULL) {
+        int home = hash_id(index->slots[next]->carriage_id) & mask;
+        // moves the entry back if the hole lies between its home and its slot
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->slots[hole] = index->slots[next];
+            index->slots[next] = NULL;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Doubles the number of slots in the index and rehashes its carriages.
+//
+// Parameters:
+//      *index      - struct *, index to grow
+//
+void index_grow(struct id_index *index) {
+    struct carriage **old_slots = index->slots;
+    int old_size = index->size;
+
+    if (old_size == 0) {
+        index->size = INDEX_MIN_SIZE;
+    } else {
+        index->size = old_size * 2;
+    }
+    index->slots = allocate_zeroed(index->size, sizeof(struct carriage *));
+    index->count = 0;
+
+    int i = 0;
+    while (i < old_size) {
+        if (old_slots[i] != NULL) {
+            index_insert(index, old_slots[i]);
+        }
+        i++;
+    }
+    deallocate(old_slots);
+}
+
+// Frees the index's table and leaves it empty.
+//
+// Parameters:
+//      *index      - struct *, index to free
+//
+void index_free(struct id_index *index) {
+    deallocate(index->slots);
+    index->slots = NULL;
+    index->size = 0;
+    index->count = 0;
+}
+
+// Finds the tree priority of a new carriage by scrambling the hash of its ID,
+// so that priorities are spread evenly no matter the order of insertion.
+//
+// Parameters:
+//      id[ID_SIZE] - string, which contains the carriage ID
+//
+// Returns:
+//      The priority of the carriage.
+//
+unsigned int carriage_priority(char id[ID_SIZE]) {
+    unsigned int priority = hash_id(id);
+    priority ^= priority >> 16;
+    priority *= 0x85ebca6bu;
+    priority ^= priority >> 13;
+    priority *= 0xc2b2ae35u;
+    priority ^= priority >> 16;
+    return priority;
+}
+
+// Counts the carriages in a subtree
+//
+// Parameters:
+//      *root   - struct *, root of the subtree, may be NULL.
+//
+// Returns:
+//      Number of carriages in the subtree.
+//
+int subtree_size(struct carriage *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return root->size;
+}
+
+// Finds the total capacity and occupancy of a subtree
+//
+// Parameters:
+//      *root   - struct *, root of the subtree, may be NULL.
+//
+// Returns:
+//      The capacity, occupied and unoccupied seats of the subtree.
+//
+struct space subtree_totals(struct carriage *root) {
+    struct space total;
+    total.capacity = 0;
+    total.occupied = 0;
+    if (root != NULL) {
+        total.capacity = root->total_capacity;
+        total.occupied = root->total_occupancy;
+    }
+    total.unoccupied = total.capacity - total.occupied;
+    return total;
+}
+
+// Recalculates the subtree totals of a carriage from its children,
+// and points its children back at it.
+//
+// Parameters:
+//      *carriage   - struct *, carriage to update
+//
+void update_totals(struct carriage *carriage) {
+    carriage->size = 1 + subtree_size(carriage->left) 
+                     + subtree_size(carriage->right);
+    carriage->total_capacity = carriage->capacity 
+                               + subtree_totals(carriage->left).capacity
+                               + subtree_totals(carriage->right).capacity;
+    carriage->total_occupancy = carriage->occupancy 
+                                + subtree_totals(carriage->left).occupied
+                                + subtree_totals(carriage->right).occupied;
+    carriage->total_happiness = happiness_points(carriage)
+                                + subtree_happiness(carriage->left)
+                                + subtree_happiness(carriage->right);
+    if (carriage->left != NULL) {
+        carriage->left->parent = carriage;
+    }
+    if (carriage->right != NULL) {
+        carriage->right->parent = carriage;
+    }
+}
+
+// Finds the total happiness of the passengers in a subtree.
+//
+// Parameters:
+//      *root   - struct *, root of the subtree, may be NULL.
+//
+// Returns:
+//      The happiness total, in HAPPINESS_SCALE parts of a point.
+//
+long long subtree_happiness(struct carriage *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return root->total_happiness;
+}
+
+// Finds how happy a passenger is to be in a type of carriage, before 
+// crowding is taken into account.
+//
+// Parameters:
+//      type    - enum, type of the carriage
+//
+// Returns:
+//      The happiness, out of 100.
+//
+int type_happiness(enum carriage_type type) {
+    if (type == BUFFET) {
+        return BUFFET_HAPPINESS;
+    } 
+    else if (type == RESTROOM) {
+        return RESTROOM_HAPPINESS;
+    } 
+    else if (type == FIRST_CLASS) {
+        return FIRST_CLASS_HAPPINESS;
+    }
+    return PASSENGER_HAPPINESS;
+}
+
+// Finds the total happiness of the passengers in a carriage. Each 
+// passenger starts at the happiness of the carriage's type and loses up 
+// to CROWDING_PENALTY as the carriage fills. The total is kept in whole 
+// HAPPINESS_SCALE parts of a point, so the sums of it don't depend on 
+// the order they were added up in. The crowding is divided by the 
+// capacity, so it is rounded to the nearest part: a train's total is 
+// within half a part per carriage of the sum of the 'h' results, far 
+// below the tenth of a point 'H' prints.
+//
+// Parameters:
+//      *carriage   - struct *, the carriage
+//
+// Returns:
+//      The happiness total, in HAPPINESS_SCALE parts of a point.
+//
+long long happiness_points(struct carriage *carriage) {
+    long long occupancy = carriage->occupancy;
+    long long crowding = occupancy * occupancy * CROWDING_PENALTY 
+                         * HAPPINESS_SCALE;
+    return occupancy * type_happiness(carriage->type) * HAPPINESS_SCALE
+           - (crowding * 2 + carriage->capacity) / (carriage->capacity * 2);
+}
+
+// Finds the happiness of each passenger in a carriage.
+//
+// Parameters:
+//      *carriage   - struct *, the carriage
+//
+// Returns:
+//      The happiness, out of 100.
+//
+double carriage_happiness(struct carriage *carriage) {
+    return type_happiness(carriage->type) 
+           - (double)CROWDING_PENALTY * carriage->occupancy 
+             / carriage->capacity;
+}
+
+// Prints the happiness of the passengers in a carriage, 
+// found straight from the carriage.
+//
+// Parameters:
+//      *train  - struct *, train the carriage is in
+//      id      - string, the carriage's ID
+//
+void print_carriage_happiness(struct train *train, char id[ID_SIZE]) {
+    struct carriage *carriage = find_id(train, id);
+    if (carriage == NULL) {
+        print_out("ERROR: No carriage exists with id: '%s'\n", id);
+    } 
+    else if (carriage->occupancy == 0) {
+        print_out("There are no passengers in carriage '%s'\n", id);
+    } else {
+        print_out("The happiness of passengers in carriage '%s' is %.1lf\n",
+                  id, carriage_happiness(carriage));
+    }
+}
+
+// Prints the average happiness of every passenger on a train, 
+// found from the totals at the root of its tree.
+//
+// Parameters:
+//      *train  - struct *, the train
+//
+void print_train_happiness(struct train *train) {
+    int passengers = subtree_totals(train->carriages).occupied;
+    if (passengers == 0) {
+        print_out("There are no passengers on the train\n");
+        return;
+    }
+    double average = (double)subtree_happiness(train->carriages) 
+                     / HAPPINESS_SCALE / passengers;
+    print_out("The average happiness of the train is %.1lf\n", average);
+}
+
+// Rearranges the passengers on a train to make them as happy as possible.
+// A carriage's happiness total is concave in its occupancy, so each extra
+// passenger in a carriage adds less than the one before. The best 
+// arrangement fills every carriage with the passengers whose extra 
+// happiness is above some threshold, which is found by bisection, with 
+// any passengers left over at the threshold spread from the front. 
+// This takes O(n log n) time for a train of n carriages.
+//
+// Parameters:
+//      *train  - struct *, the train to rearrange
+//
+// Returns:
+//      VALID   - if any passengers were moved
+//      INVALID - if not
+//
+int optimise_happiness(struct train *train) {
+    int passengers = subtree_totals(train->carriages).occupied;
+    if (passengers == 0) {
+        print_out("There are no passengers on the train\n");
+        return INVALID;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double before = (double)subtree_happiness(train->carriages) 
+                    / HAPPINESS_SCALE / passengers;
+
+    // the threshold where fewer than all passengers have a seat above it, 
+    // and the one where there are seats for all of them.
+    double high = FIRST_CLASS_HAPPINESS + 1;
+    double low = -CROWDING_PENALTY * 2.0;
+    int step = 0;
+    while (step < OPTIMISE_STEPS) {
+        double middle = (low + high) / 2;
+        if (seats_above(train->carriages, middle) >= passengers) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+        step++;
+    }
+
+    // seats everyone above the higher threshold, then the rest in the 
+    // seats between the two thresholds.
+    int left_over = passengers - seats_above(train->carriages, high);
+    int is_moved = INVALID;
+    struct carriage *current = find_start(train->carriages);
+    while (current != NULL) {
+        int seats = carriage_seats_above(current, high);
+        int extra = carriage_seats_above(current, low) - seats;
+        if (extra > left_over) {
+            extra = left_over;
+        }
+        if (current->occupancy != seats + extra) {
+            current->occupancy = seats + extra;
+            is_moved = VALID;
+        }
+        left_over -= extra;
+        current = next_carriage(current);
+    }
+    update_all_totals(train->carriages);
+
+    double after = (double)subtree_happiness(train->carriages) 
+                   / HAPPINESS_SCALE / passengers;
+    double time_taken = elapsed_ns(&start) / 1000000.0;
+    if (compare_double(after, before) > 0) {
+        print_out("Average happiness raised from %.1lf to %.1lf in %.3lf ms\n",
+                  before, after, time_taken);
+    } else {
+        print_out("Average happiness is already at its best: %.1lf\n", 
+                  after);
+    }
+    return is_moved;
+}
+
+// Counts the seats in a tree of carriages where a passenger would add at 
+// least threshold to the carriage's happiness total.
+//
+// Parameters:
+//      *root       - struct *, root of the tree, may be NULL.
+//      threshold   - double, happiness each seat must add
+//
+// Returns:
+//      The number of seats.
+//
+int seats_above(struct carriage *root, double threshold) {
+    int seats = 0;
+    struct carriage *current = find_start(root);
+    while (current != NULL) {
+        seats += carriage_seats_above(current, threshold);
+        current = next_carriage(current);
+    }
+    return seats;
+}
+
+// Counts the seats in a carriage where a passenger would add at least
+// threshold to the carriage's happiness total. Passenger k adds the type's
+// happiness less CROWDING_PENALTY * (2k - 1) / capacity.
+//
+// Parameters:
+//      *carriage   - struct *, the carriage
+//      threshold   - double, happiness each seat must add
+//
+// Returns:
+//      The number of seats, between 0 and the carriage's capacity.
+//
+int carriage_seats_above(struct carriage *carriage, double threshold) {
+    double most = ((type_happiness(carriage->type) - threshold) 
+                   * carriage->capacity / CROWDING_PENALTY + 1) / 2;
+    if (most <= 0) {
+        return 0;
+    }
+    if (most >= carriage->capacity) {
+        return carriage->capacity;
+    }
+    return (int)most;
+}
+
+// Recalculates the subtree totals of a carriage and all of its ancestors,
+// after the carriage's capacity or occupancy has changed.
+//
+// Parameters:
+//      *carriage   - struct *, carriage that changed, may be NULL.
+//
+void update_ancestors(struct carriage *carriage) {
+    while (carriage != NULL) {
+        update_totals(carriage);
+        carriage = carriage->parent;
+    }
+}
+
+// Recalculates the subtree totals of every carriage in a tree, 
+// children before their parents.
+//
+// Parameters:
+//      *root   - struct *, root of the tree, may be NULL.
+//
+void update_all_totals(struct carriage *root) {
+    if (root != NULL) {
+        update_all_totals(root->left);
+        update_all_totals(root->right);
+        update_totals(root);
+    }
+}
+
+// Builds a tree out of a list of carriages in linear time, keeping their 
+// order. The carriages already on the right edge of the tree are kept on 
+// a stack, which reuses the front of the list. Each new carriage takes 
+// the carriages with lower priorities off the stack as its left subtree, 
+// giving the same shape join_carriages would.
+//
+// Parameters:
+//      **carriages - struct **, the carriages in order, overwritten.
+//      count       - int, number of carriages
+//
+// Returns:
+//      The root of the tree, with no parent, or NULL if count is 0.
+//
+struct carriage *build_carriages(struct carriage **carriages, int count) {
+    int stack_size = 0;
+    int i = 0;
+    while (i < count) {
+        struct carriage *current = carriages[i];
+        struct carriage *below = NULL;
+        // a carriage's subtree is finished when it leaves the stack
+        while (stack_size > 0 
+               && carriages[stack_size - 1]->priority < current->priority) {
+            stack_size--;
+            below = carriages[stack_size];
+            update_totals(below);
+        }
+        current->left = below;
+        current->right = NULL;
+        if (stack_size > 0) {
+            carriages[stack_size - 1]->right = current;
+        }
+        carriages[stack_size] = current;
+        stack_size++;
+        i++;
+    }
+    while (stack_size > 0) {
+        stack_size--;
+        update_totals(carriages[stack_size]);
+    }
+
+    if (count == 0) {
+        return NULL;
+    }
+    carriages[0]->parent = NULL;
+    return carriages[0];
+}
+
+// Joins two trees of carriages, keeping the carriages of the front tree
+// before those of the back tree. 
+// The parent of the returned root must be set by the caller.
+//
+// Parameters:
+//      *front  - struct *, root of the carriages to go first, may be NULL.
+//      *back   - struct *, root of the carriages to go last, may be NULL.
+//
+// Returns:
+//      The root of the joined tree.
+//
+struct carriage *join_carriages(struct carriage *front, struct carriage *back) {
+    if (front == NULL) {
+        return back;
+    } else if (back == NULL) {
+        return front;
+    } else if (front->priority >= back->priority) {
+        front->right = join_carriages(front->right, back);
+        update_totals(front);
+        return front;
+    } else {
+        back->left = join_carriages(front, back->left);
+        update_totals(back);
+        return back;
+    }
+}
+
+// Splits a tree of carriages in two at the given position.
+// The parents of the two roots must be set by the caller.
+//
+// Parameters:
+//      *root       - struct *, root of the carriages to split, may be NULL.
+//      position    - int, number of carriages to put in the front tree.
+//      **front     - struct **, set to the root of the front carriages.
+//      **back      - struct **, set to the root of the remaining carriages.
+//
+void split_carriages(struct carriage *root, int position, 
+                     struct carriage **front, struct carriage **back) {
+    if (root == NULL) {
+        *front = NULL;
+        *back = NULL;
+    } else if (subtree_size(root->left) < position) {
+        split_carriages(root->right, position - subtree_size(root->left) - 1,
+                        &root->right, back);
+        update_totals(root);
+        *front = root;
+    } else {
+        split_carriages(root->left, position, front, &root->left);
+        update_totals(root);
+        *back = root;
+    }
+}
+
+// Sets the root of a train's carriage tree.
+//
+// Parameters:
+//      *train  - struct *, train to update
+//      *root   - struct *, new root of the carriages, may be NULL.
+//
+void set_carriages(struct train *train, struct carriage *root) {
+    train->carriages = root;
+    if (root != NULL) {
+        root->parent = NULL;
+    }
+}
+
+// Takes a carriage out of a train's tree, without freeing it.
+//
+// Parameters:
+//      *train      - struct *, train containing the carriage
+//      *carriage   - struct *, carriage to unlink
+//
+void unlink_carriage(struct train *train, struct carriage *carriage) {
+    struct carriage *parent = carriage->parent;
+    struct carriage *replacement = join_carriages(carriage->left, 
+                                                  carriage->right);
+    if (parent == NULL) {
+        set_carriages(train, replacement);
+        return;
+    }
+    
+    if (parent->left == carriage) {
+        parent->left = replacement;
+    } else {
+        parent->right = replacement;
+    }
+    update_ancestors(parent);
+}
+
+// Follows the tree down to the first carriage of the train
+//
+// Parameters: 
+//      *root   - struct *, the root of the carriage tree, may be NULL.
+//
+// Return:
+//      struct * to the first carriage in the train, or NULL if it is empty.
+// 
+struct carriage *find_start(struct carriage *root) {
+    struct carriage *current = root;
+    while (current != NULL && current->left != NULL) {
+        current = current->left;  
+        stats.tree_steps++;
+    } 
+    return current;
+}
+
+// Finds the carriage after the current one in the train.
+//
+// Parameters: 
+//      *current    - struct *, carriage to step from.
+//
+// Return:
+//      struct * to the next carriage, or NULL if current is the last one.
+// 
+struct carriage *next_carriage(struct carriage *current) {
+    if (current->right != NULL) {
+        return find_start(current->right);
+    }
+    while (current->parent != NULL && current->parent->right == current) {
+        current = current->parent;
+        stats.tree_steps++;
+    }
+    return current->parent;
+}
+
+// Finds the carriage at a position in a train by following the subtree
+// sizes down the tree.
+//
+// Parameters:
+//      *root       - struct *, the root of the train's carriage tree.
+//      position    - int, position of the carriage, counting from 0
+//
+// Returns:
+//      The carriage, or NULL if the position is past the end of the train.
+//
+struct carriage *carriage_at(struct carriage *root, int position) {
+    struct carriage *current = root;
+    while (current != NULL) {
+        stats.tree_steps++;
+        int left_size = subtree_size(current->left);
+        if (position < left_size) {
+            current = current->left;
+        } 
+        else if (position == left_size) {
+            return current;
+        } else {
+            position -= left_size + 1;
+            current = current->right;
+        }
+    }
+    return NULL;
+}
+
+// Finds the position of a carriage in its train
+//
+// Parameters: 
+//      *carriage   - struct *, carriage to find the position of.
+//
+// Return:
+//      number of carriages before the carriage in the train.
+//
+int carriage_position(struct carriage *carriage) {
+    int position = subtree_size(carriage->left);
+    while (carriage->parent != NULL) {
+        if (carriage->parent->right == carriage) {
+            position += subtree_size(carriage->parent->left) + 1;
+        }
+        carriage = carriage->parent;
+        stats.tree_steps++;
+    }
+    return position;
+}
+
+// Totals the capacity and occupancy of the carriages before a carriage
+//
+// Parameters: 
+//      *carriage   - struct *, carriage to total up to.
+//
+// Return:
+//      capacity, occupied and unoccupied seats before the carriage.
+//
+struct space totals_before(struct carriage *carriage) {
+    struct space total = subtree_totals(carriage->left);
+    while (carriage->parent != NULL) {
+        struct carriage *parent = carriage->parent;
+        if (parent->right == carriage) {
+            struct space left = subtree_totals(parent->left);
+            total.capacity += left.capacity + parent->capacity;
+            total.occupied += left.occupied + parent->occupancy;
+        }
+        carriage = parent;
+        stats.tree_steps++;
+    }
+    total.unoccupied = total.capacity - total.occupied;
+    return total;
+}
+
+// Finds the carriage the last of total passengers would be seated in, if
+// they were seated from a carriage onwards. Follows the cached free seats
+// down the tree to the free seat they would fill last.
+//
+// Parameters: 
+//      *train      - struct *, train the carriage is in.
+//      *carriage   - struct *, carriage to start seating from.
+//      total       - int, number of passengers, at least 1.
+//
+// Return:
+//      The carriage, or NULL if the passengers don't all fit.
+//
+struct carriage *find_last_seated(struct train *train, 
+                                  struct carriage *carriage, int total) {
+    // the free seat to find, counting from the start of the train
+    int seat = totals_before(carriage).unoccupied + total;
+    struct carriage *current = train->carriages;
+    while (current != NULL) {
+        stats.tree_steps++;
+        int left_free = subtree_totals(current->left).unoccupied;
+        int own_free = current->capacity - current->occupancy;
+        if (seat <= left_free) {
+            current = current->left;
+        } 
+        else if (seat <= left_free + own_free) {
+            return current;
+        } else {
+            seat -= left_free + own_free;
+            current = current->right;
+        }
+    }
+    return NULL;
+}
+
+// Checks if a carriage has a free seat
+//
+// Parameters: 
+//      *carriage   - struct *, carriage to check.
+//
+// Return:
+//      VALID   - if there is a free seat
+//      INVALID - if not
+//
+int has_space(struct carriage *carriage) {
+    return validity(carriage->capacity > carriage->occupancy);
+}
+
+// Follows the tree down to the first carriage with a free seat
+//
+// Parameters: 
+//      *root   - struct *, root of a subtree with at least one free seat.
+//
+// Return:
+//      struct * to the first carriage in the subtree with a free seat.
+//
+struct carriage *first_space(struct carriage *root) {
+    struct carriage *current = root;
+    while (1) {
+        stats.tree_steps++;
+        if (subtree_totals(current->left).unoccupied > 0) {
+            current = current->left;
+        } else if (has_space(current)) {
+            return current;
+        } else {
+            current = current->right;
+        }
+    }
+}
+
+// Finds the first carriage with a free seat, starting from the current one.
+//
+// Parameters: 
+//      *current    - struct *, carriage to search from, may be NULL.
+//
+// Return:
+//      struct * to the carriage, or NULL if there are no free seats from 
+//      the current carriage to the end of the train.
+//
+struct carriage *find_space(struct carriage *current) {
+    if (current == NULL || has_space(current)) {
+        return current;
+    }
+    if (subtree_totals(current->right).unoccupied > 0) {
+        return first_space(current->right);
+    }
+    // climbs until we come up from a left subtree, the parent and its 
+    // right subtree are then the next carriages in the train.
+    while (current->parent != NULL) {
+        struct carriage *parent = current->parent;
+        if (parent->left == current) {
+            if (has_space(parent)) {
+                return parent;
+            }
+            if (subtree_totals(parent->right).unoccupied > 0) {
+                return first_space(parent->right);
+            }
+        }
+        current = parent;
+        stats.tree_steps++;
+    }
+    return NULL;
+}
+
+// Mallocs a new, empty pool.
+//
+// Returns:
+//      The new pool.
+//
+struct pool *create_pool(void) {
+    struct pool *pool = allocate(sizeof(struct pool));
+    pool->free_carriages = NULL;
+    pool->free_trains = NULL;
+    pool->carriage_slabs = NULL;
+    pool->carriages_used = CARRIAGE_SLAB_SIZE;
+    pool->train_slabs = NULL;
+    pool->trains_used = TRAIN_SLAB_SIZE;
+    pool->is_shared = INVALID;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Locks a pool, if other threads share it.
+//
+// Parameters:
+//      *pool   - struct *, pool to lock
+//
+void lock_pool(struct pool *pool) {
+    if (pool->is_shared) {
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+// Unlocks a pool locked with lock_pool.
+//
+// Parameters:
+//      *pool   - struct *, pool to unlock
+//
+void unlock_pool(struct pool *pool) {
+    if (pool->is_shared) {
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Takes a carriage node from the pool. Freed carriages are reused first, 
+// breaking up the freed tree on top of the stack one node at a time.
+// Otherwise the node comes from the newest slab, mallocing a new slab 
+// when it is used up.
+//
+// Parameters:
+//      *pool   - struct *, pool to allocate from
+//
+// Returns:
+//      An uninitialised carriage node.
+//
+struct carriage *pool_alloc_carriage(struct pool *pool) {
+    lock_pool(pool);
+    struct carriage *new = pool->free_carriages;
+    if (new != NULL) {
+        pool->free_carriages = new->parent;
+        // pushes the node's subtrees so their carriages are reused later.
+        if (new->left != NULL) {
+            new->left->parent = pool->free_carriages;
+            pool->free_carriages = new->left;
+        }
+        if (new->right != NULL) {
+            new->right->parent = pool->free_carriages;
+            pool->free_carriages = new->right;
+        }
+        unlock_pool(pool);
+        return new;
+    }
+
+    if (pool->carriages_used == CARRIAGE_SLAB_SIZE) {
+        struct carriage_slab *slab = allocate_aligned(CACHE_LINE, 
+                                                   carriage_slab_bytes());
+        slab->next = pool->carriage_slabs;
+        pool->carriage_slabs = slab;
+        pool->carriages_used = 0;
+    }
+    new = &pool->carriage_slabs->carriages[pool->carriages_used];
+    pool->carriages_used++;
+    unlock_pool(pool);
+    return new;
+}
+
+// Finds the number of bytes to allocate for a carriage slab,
+// rounded up to a whole number of cache lines as aligned_alloc requires.
+//
+// Returns:
+//      Size of a carriage slab in bytes.
+//
+int carriage_slab_bytes(void) {
+    int lines = (sizeof(struct carriage_slab) + CACHE_LINE - 1) / CACHE_LINE;
+    return lines * CACHE_LINE;
+}
+
+// Hands a single carriage node back to the pool. 
+// The carriage must already be unlinked from its train.
+//
+// Parameters:
+//      *pool       - struct *, pool the carriage came from
+//      *carriage   - struct *, carriage to free
+//
+void pool_free_carriage(struct pool *pool, struct carriage *carriage) {
+    carriage->left = NULL;
+    carriage->right = NULL;
+    pool_free_carriages(pool, carriage);
+}
+
+// Hands a whole tree of carriages back to the pool at once.
+//
+// Parameters:
+//      *pool   - struct *, pool the carriages came from
+//      *root   - struct *, root of the carriages to free, may be NULL.
+//
+void pool_free_carriages(struct pool *pool, struct carriage *root) {
+    if (root != NULL) {
+        lock_pool(pool);
+        root->parent = pool->free_carriages;
+        pool->free_carriages = root;
+        unlock_pool(pool);
+    }
+}
+
+// Takes a train node from the pool, reusing a freed train if there is one.
+//
+// Parameters:
+//      *pool   - struct *, pool to allocate from
+//
+// Returns:
+//      An uninitialised train node.
+//
+struct train *pool_alloc_train(struct pool *pool) {
+    lock_pool(pool);
+    struct train *new = pool->free_trains;
+    if (new != NULL) {
+        pool->free_trains = new->next_free;
+        unlock_pool(pool);
+        return new;
+    }
+
+    if (pool->trains_used == TRAIN_SLAB_SIZE) {
+        struct train_slab *slab = allocate(sizeof(struct train_slab));
+        slab->next = pool->train_slabs;
+        pool->train_slabs = slab;
+        pool->trains_used = 0;
+    }
+    new = &pool->train_slabs->trains[pool->trains_used];
+    pool->trains_used++;
+    unlock_pool(pool);
+    return new;
+}
+
+// Hands a train node back to the pool. Its carriages must be freed first.
+//
+// Parameters:
+//      *pool   - struct *, pool the train came from
+//      *train  - struct *, train to free
+//
+void pool_free_train(struct pool *pool, struct train *train) {
+    pthread_mutex_destroy(&train->lock);
+    lock_pool(pool);
+    train->next_free = pool->free_trains;
+    pool->free_trains = train;
+    unlock_pool(pool);
+}
+
+// Frees every slab of the pool, and the pool itself. 
+// Any nodes still in use are freed with it.
+//
+// Parameters:
+//      *pool   - struct *, pool to free
+//
+void free_pool(struct pool *pool) {
+    while (pool->carriage_slabs != NULL) {
+        struct carriage_slab *carriage_slab = pool->carriage_slabs;
+        pool->carriage_slabs = carriage_slab->next;
+        deallocate(carriage_slab);
+    }
+    while (pool->train_slabs != NULL) {
+        struct train_slab *train_slab = pool->train_slabs;
+        pool->train_slabs = train_slab->next;
+        deallocate(train_slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    deallocate(pool);
+}
+
+// Sets up the input to read the commands from stdin as they are typed.
+//
+// Parameters:
+//      *input  - struct *, input to set up
+//
+void open_interactive(struct input *input) {
+    input->fd = STDIN_FILENO;
+    input->buffer = allocate(INPUT_BUFFER_SIZE);
+    input->length = 0;
+    input->position = 0;
+    input->is_batch = INVALID;
+    input->is_mapped = INVALID;
+}
+
+// Sets up the input to hold all of the commands at once. 
+// A file is memory mapped, stdin is read to its end.
+//
+// Parameters:
+//      *input  - struct *, input to set up
+//      *path   - string, file to read the commands from, NULL for stdin.
+//
+// Returns:
+//      VALID   - if the commands could be read
+//      INVALID - if not
+//
+int open_batch(struct input *input, char *path) {
+    input->buffer = NULL;
+    input->length = 0;
+    input->position = 0;
+    input->is_batch = VALID;
+    input->is_mapped = INVALID;
+    if (path == NULL) {
+        input->fd = STDIN_FILENO;
+        return read_all(input);
+    }
+
+    input->fd = open(path, O_RDONLY);
+    struct stat file_info;
+    if (input->fd < 0 || fstat(input->fd, &file_info) < 0) {
+        return INVALID;
+    }
+    // an empty file can't be mapped, but has no commands anyway.
+    if (file_info.st_size > 0) {
+        input->buffer = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE,
+                             input->fd, 0);
+        if (input->buffer == MAP_FAILED) {
+            close(input->fd);
+            return INVALID;
+        }
+        madvise(input->buffer, file_info.st_size, MADV_SEQUENTIAL);
+        input->length = file_info.st_size;
+        input->is_mapped = VALID;
+    }
+    close(input->fd);
+    return VALID;
+}
+
+// Reads everything left in the input's file into its buffer, 
+// doubling the buffer as needed.
+//
+// Parameters:
+//      *input  - struct *, input to read into
+//
+// Returns:
+//      VALID   - if the whole file was read
+//      INVALID - if there was a read error
+//
+int read_all(struct input *input) {
+    long size = INPUT_BUFFER_SIZE;
+    input->buffer = allocate(size);
+    ssize_t bytes = 1;
+    while (bytes > 0) {
+        if (input->length == size) {
+            size *= 2;
+            input->buffer = reallocate(input->buffer, size);
+        }
+        bytes = read(input->fd, input->buffer + input->length, 
+                     size - input->length);
+        if (bytes > 0) {
+            input->length += bytes;
+        }
+    }
+    return validity(bytes == 0);
+}
+
+// Frees or unmaps the input's buffer.
+//
+// Parameters:
+//      *input  - struct *, input to close
+//
+void close_input(struct input *input) {
+    if (input->is_mapped) {
+        munmap(input->buffer, input->length);
+    } else {
+        deallocate(input->buffer);
+    }
+}
+
+// Reads the next block of input into the buffer. In batch mode everything 
+// is already in the buffer, so there is nothing more to read.
+//
+// Parameters:
+//      *input  - struct *, input to read into
+//
+// Returns:
+//      VALID   - if more input was read
+//      INVALID - at the end of the input
+//
+int refill_input(struct input *input) {
+    if (input->is_batch) {
+        return INVALID;
+    }
+    // shows the prompt and output so far before waiting on the user, 
+    // and records the commands so far while the user is typing
+    flush_output();
+    flush_journal();
+    ssize_t bytes = read(input->fd, input->buffer, INPUT_BUFFER_SIZE);
+    if (bytes <= 0) {
+        return INVALID;
+    }
+    input->length = bytes;
+    input->position = 0;
+    return VALID;
+}
+
+// Looks at the next character of the input without consuming it
+//
+// Parameters:
+//      *input  - struct *, input to read from
+//
+// Returns:
+//      The next character, or EOF at the end of the input.
+//
+int peek_char(struct input *input) {
+    if (input->position == input->length && !refill_input(input)) {
+        return EOF;
+    }
+    return (unsigned char)input->buffer[input->position];
+}
+
+// Consumes the next character of the input
+//
+// Parameters:
+//      *input  - struct *, input to read from
+//
+// Returns:
+//      The character, or EOF at the end of the input.
+//
+int next_char(struct input *input) {
+    int c = peek_char(input);
+    if (c != EOF) {
+        input->position++;
+    }
+    return c;
+}
+
+// Consumes any whitespace at the front of the input
+//
+// Parameters:
+//      *input  - struct *, input to read from
+//
+void skip_space(struct input *input) {
+    while (isspace(peek_char(input))) {
+        input->position++;
+    }
+}
+
+// Scans in an integer, the same way as scanf(" %d") would. Numbers too 
+// big for an int are clamped to INT_MAX or INT_MIN.
+//
+// Parameters:
+//      *input  - struct *, input to read from
+//
+// Returns:
+//      The integer, or 0 if the input was not a number.
+//
+int scan_int(struct input *input) {
+    skip_space(input);
+    int sign = 1;
+    if (peek_char(input) == '-' || peek_char(input) == '+') {
+        if (next_char(input) == '-') {
+            sign = -1;
+        }
+    }
+    // stops growing once it is past an int, but still reads every digit
+    long long value = 0;
+    while (isdigit(peek_char(input))) {
+        int digit = next_char(input) - '0';
+        if (value <= INT_MAX) {
+            value = value * 10 + digit;
+        }
+    }
+    value *= sign;
+    if (value > INT_MAX) {
+        value = INT_MAX;
+    } 
+    else if (value < INT_MIN) {
+        value = INT_MIN;
+    }
+    return value;
+}
+
+// Scans in the next command letter and all of its arguments.
+//
+// Parameters:
+//      *input      - struct *, input to read from
+//      *command    - struct *, filled in with the command
+//
+// Returns:
+//      VALID   - if a command was read
+//      INVALID - at the end of the input
+//
+int scan_command(struct input *input, struct command *command) {
+    skip_space(input);
+    int code = next_char(input);
+    if (code == EOF) {
+        return INVALID;
+    }
+    command->code = code;
+
+    if (code == ADD || code == INSERT) {
+        if (code == INSERT) {
+            command->n = scan_int(input);
+        }
+        scan_id(input, command->id);
+        command->type = scan_type(input);
+        command->capacity = scan_int(input);
+    }
+    else if (code == SEAT || code == DISEMBARK) {
+        scan_id(input, command->id);
+        command->n = scan_int(input);
+    }
+    else if (code == COUNT) {
+        scan_id(input, command->id);
+        scan_id(input, command->other_id);
+    }
+    else if (code == MOVE) {
+        scan_id(input, command->id);
+        scan_id(input, command->other_id);
+        command->n = scan_int(input);
+    }
+    else if (code == REMOVE || code == HAPPINESS) {
+        scan_id(input, command->id);
+    }
+    else if (code == SELECT || code == SWITCH_NETWORK) {
+        command->n = scan_int(input);
+    }
+    else if (code == SAVE || code == LOAD) {
+        command->path[0] = '\0';
+        scan_token(input, command->path, PATH_SIZE);
+    }
+    else if (code == PRINT_RANGE || code == PRINT_TRAINS) {
+        command->n = scan_int(input);
+        command->other_n = scan_int(input);
+    }
+    else if (code == SPLIT || code == BULK_SEAT || code == BULK_DISEMBARK) {
+        command->n = scan_int(input);
+        if (code == SPLIT && is_pos(command->n)) {
+            print_prompt("Enter ids: \n");
+        }
+        // IDs are only given if the number of splits or loads is valid, 
+        // stopping early if the input runs out. Each load's ID is 
+        // followed by its number of passengers.
+        int item = 0;
+        while (item < command->n) {
+            skip_space(input);
+            if (peek_char(input) == EOF) {
+                break;
+            }
+            reserve_ids(command, item + 1);
+            scan_id(input, command->ids[item]);
+            if (code != SPLIT) {
+                command->loads[item] = scan_int(input);
+            }
+            item++;
+        }
+        if (is_pos(command->n)) {
+            command->n = item;
+        }
+    }
+    return VALID;
+}
+
+// Makes sure a command has room for count IDs and their loads.
+//
+// Parameters:
+//      *command    - struct *, command to make room in
+//      count       - int, number of IDs needed
+//
+void reserve_ids(struct command *command, int count) {
+    if (count <= command->ids_size) {
+        return;
+    }
+    command->ids_size = command->ids_size * 2 + 1;
+    if (command->ids_size < count) {
+        command->ids_size = count;
+    }
+    command->ids = reallocate(command->ids, command->ids_size * ID_SIZE);
+    command->loads = reallocate(command->loads, 
+                                command->ids_size * sizeof(int));
+}
+
+// Reads the command line options. 
+//      --batch [file]  read all of the commands at once, from file or stdin
+//      --quiet         don't print confirmations or prompts
+//      --bench [n] [m] time each command on n trains of m carriages
+//      --generate seed count
+//                      print a reproducible script of count valid commands
+//      --journal file  record every change in file, and recover the
+//                      network from it on startup
+//      --desks file... run the commands in each file at its own desk, 
+//                      all at once
+//      --shards file...
+//                      run the commands in each file on its own networks, 
+//                      all at once
+//      --stats file    write what every command cost to file as JSON at exit
+//
+// Parameters:
+//      argc        - int, number of arguments
+//      *argv[]     - string array, the arguments
+//      *options    - struct *, filled in with the options
+//
+// Returns:
+//      VALID   - if the options are valid
+//      INVALID - if not, after printing an error
+//
+int parse_options(int argc, char *argv[], struct options *options) {
+    options->is_batch = INVALID;
+    options->batch_path = NULL;
+    options->is_quiet = INVALID;
+    options->is_bench = INVALID;
+    options->bench_trains = BENCH_TRAINS;
+    options->bench_carriages = BENCH_CARRIAGES;
+    options->is_generate = INVALID;
+    options->journal_path = NULL;
+    options->num_desks = 0;
+    options->desk_paths = NULL;
+    options->num_shards = 0;
+    options->shard_paths = NULL;
+    options->stats_path = NULL;
+
+    int arg = 1;
+    while (arg < argc) {
+        if (strcmp(argv[arg], BATCH_FLAG) == 0) {
+            options->is_batch = VALID;
+            // the file is optional
+            if (arg + 1 < argc && argv[arg + 1][0] != '-') {
+                arg++;
+                options->batch_path = argv[arg];
+            }
+        }
+        else if (strcmp(argv[arg], QUIET_FLAG) == 0) {
+            options->is_quiet = VALID;
+        }
+        else if (strcmp(argv[arg], BENCH_FLAG) == 0) {
+            options->is_bench = VALID;
+            // the network size is optional
+            if (arg + 2 < argc && isdigit(argv[arg + 1][0]) 
+                && isdigit(argv[arg + 2][0])) {
+                options->bench_trains = atoi(argv[arg + 1]);
+                options->bench_carriages = atoi(argv[arg + 2]);
+                arg += 2;
+            }
+            if (options->bench_trains < 2 || options->bench_carriages < 2) {
+                fprintf(stderr, "ERROR: need at least 2 trains of 2 "
+                        "carriages to benchmark\n");
+                return INVALID;
+            }
+        }
+        else if (strcmp(argv[arg], GENERATE_FLAG) == 0) {
+            options->is_generate = VALID;
+            if (arg + 2 >= argc || !isdigit(argv[arg + 1][0]) 
+                || !isdigit(argv[arg + 2][0])) {
+                fprintf(stderr, "ERROR: %s needs a seed and a count\n", 
+                        GENERATE_FLAG);
+                return INVALID;
+            }
+            options->generate_seed = strtoul(argv[arg + 1], NULL, 10);
+            options->generate_count = atoi(argv[arg + 2]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], JOURNAL_FLAG) == 0) {
+            if (arg + 1 >= argc) {
+                fprintf(stderr, "ERROR: %s needs a file\n", JOURNAL_FLAG);
+                return INVALID;
+            }
+            arg++;
+            options->journal_path = argv[arg];
+        }
+        else if (strcmp(argv[arg], DESKS_FLAG) == 0) {
+            // every argument up to the next option is a desk's file
+            options->desk_paths = &argv[arg + 1];
+            while (arg + 1 < argc && argv[arg + 1][0] != '-') {
+                arg++;
+                options->num_desks++;
+            }
+            if (options->num_desks == 0) {
+                fprintf(stderr, "ERROR: %s needs a file for each desk\n", 
+                        DESKS_FLAG);
+                return INVALID;
+            }
+        }
+        else if (strcmp(argv[arg], STATS_FLAG) == 0) {
+            if (arg + 1 >= argc) {
+                fprintf(stderr, "ERROR: %s needs a file\n", STATS_FLAG);
+                return INVALID;
+            }
+            arg++;
+            options->stats_path = argv[arg];
+        }
+        else if (strcmp(argv[arg], SHARDS_FLAG) == 0) {
+            // every argument up to the next option is a shard's file
+            options->shard_paths = &argv[arg + 1];
+            while (arg + 1 < argc && argv[arg + 1][0] != '-') {
+                arg++;
+                options->num_shards++;
+            }
+            if (options->num_shards == 0) {
+                fprintf(stderr, "ERROR: %s needs a file for each shard\n", 
+                        SHARDS_FLAG);
+                return INVALID;
+            }
+        } else {
+            fprintf(stderr, "ERROR: Unknown option '%s'\n", argv[arg]);
+            return INVALID;
+        }
+        arg++;
+    }
+    if (options->num_desks > 0 && options->journal_path != NULL) {
+        fprintf(stderr, "ERROR: %s can't be used with %s\n", JOURNAL_FLAG, 
+                DESKS_FLAG);
+        return INVALID;
+    }
+    if (options->num_shards > 0 && options->journal_path != NULL) {
+        fprintf(stderr, "ERROR: %s can't be used with %s\n", JOURNAL_FLAG, 
+                SHARDS_FLAG);
+        return INVALID;
+    }
+    return VALID;
+}
+
+// Sets up the output everything is printed to.
+//
+// Parameters:
+//      fd          - int, file descriptor to write the output to
+//      is_quiet    - int, VALID if confirmations and prompts are left out
+//
+void open_output(int fd, int is_quiet) {
+    sink.fd = fd;
+    sink.buffer = allocate(OUTPUT_BUFFER_SIZE);
+    sink.length = 0;
+    sink.is_quiet = is_quiet;
+    sink.is_muted = INVALID;
+}
+
+// Writes out everything in the output's buffer.
+//
+void flush_output(void) {
+    write_all(sink.buffer, sink.length);
+    sink.length = 0;
+}
+
+// Writes text straight to the output's file, bypassing the buffer. Nothing is 
+// written while the output is muted.
+//
+// Parameters:
+//      *text   - string, text to write, need not be null terminated
+//      length  - int, number of characters of text to write
+//
+void write_all(char *text, int length) {
+    if (sink.is_muted) {
+        return;
+    }
+    pthread_mutex_lock(&output_lock);
+    int written = 0;
+    while (written < length) {
+        ssize_t bytes = write(sink.fd, text + written, length - written);
+        if (bytes <= 0) {
+            break;
+        }
+        written += bytes;
+    }
+    pthread_mutex_unlock(&output_lock);
+}
+
+// Writes out anything left in the output and frees its buffer.
+//
+void close_output(void) {
+    flush_output();
+    deallocate(sink.buffer);
+    sink.buffer = NULL;
+}
+
+// Adds text to the output, writing the buffer out first if it is too full.
+//
+// Parameters:
+//      *text   - string, text to add, need not be null terminated
+//      length  - int, number of characters of text to add
+//
+void write_out(char *text, int length) {
+    if (sink.length + length > OUTPUT_BUFFER_SIZE) {
+        flush_output();
+    }
+    if (length > OUTPUT_BUFFER_SIZE) {
+        write_all(text, length);
+        return;
+    }
+    memcpy(sink.buffer + sink.length, text, length);
+    sink.length += length;
+}
+
+// Formats text straight into the output's buffer.
+//
+// Parameters:
+//      *format - string, printf style format
+//      args    - the values to format
+//
+void vprint_out(char *format, va_list args) {
+    if (OUTPUT_BUFFER_SIZE - sink.length < MAX_LINE) {
+        flush_output();
+    }
+    va_list retry;
+    va_copy(retry, args);
+    int space = OUTPUT_BUFFER_SIZE - sink.length;
+    int length = vsnprintf(sink.buffer + sink.length, space, format, args);
+    if (length < space) {
+        sink.length += length;
+    } else {
+        // too long for the space left, so it is formatted on its own.
+        char *text = allocate(length + 1);
+        vsnprintf(text, length + 1, format, retry);
+        write_out(text, length);
+        deallocate(text);
+    }
+    va_end(retry);
+}
+
+// Prints to the output, like printf.
+//
+// Parameters:
+//      *format - string, printf style format
+//      ...     - the values to format
+//
+void print_out(char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprint_out(format, args);
+    va_end(args);
+}
+
+// Prints a confirmation that a command worked, unless in quiet mode.
+//
+// Parameters:
+//      *format - string, printf style format
+//      ...     - the values to format
+//
+void print_confirmation(char *format, ...) {
+    if (sink.is_quiet) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vprint_out(format, args);
+    va_end(args);
+}
+
+// Prints a prompt for the user, unless in quiet mode.
+//
+// Parameters:
+//      *prompt - string, the prompt
+//
+void print_prompt(char *prompt) {
+    if (!sink.is_quiet) {
+        write_out(prompt, strlen(prompt));
+    }
+}
+
+// Allocates memory with malloc, counting the call.
+//
+// Parameters:
+//      size    - size_t, number of bytes
+//
+// Returns:
+//      The memory.
+//
+void *allocate(size_t size) {
+    memory.allocations++;
+    return malloc(size);
+}
+
+// Allocates zeroed memory with calloc, counting the call.
+//
+// Parameters:
+//      count   - size_t, number of elements
+//      size    - size_t, number of bytes in each element
+//
+// Returns:
+//      The memory.
+//
+void *allocate_zeroed(size_t count, size_t size) {
+    memory.allocations++;
+    return calloc(count, size);
+}
+
+// Allocates aligned memory with aligned_alloc, counting the call.
+//
+// Parameters:
+//      alignment   - size_t, alignment of the memory in bytes
+//      size        - size_t, number of bytes, a multiple of alignment
+//
+// Returns:
+//      The memory.
+//
+void *allocate_aligned(size_t alignment, size_t size) {
+    memory.allocations++;
+    return aligned_alloc(alignment, size);
+}
+
+// Resizes memory with realloc, counting the call as an allocation.
+//
+// Parameters:
+//      *old    - void *, memory to resize, may be NULL
+//      size    - size_t, new number of bytes
+//
+// Returns:
+//      The resized memory.
+//
+void *reallocate(void *old, size_t size) {
+    memory.allocations++;
+    return realloc(old, size);
+}
+
+// Frees memory, counting the call if there was anything to free.
+//
+// Parameters:
+//      *memory_block   - void *, memory to free, may be NULL
+//
+void deallocate(void *memory_block) {
+    if (memory_block != NULL) {
+        memory.frees++;
+    }
+    free(memory_block);
+}
+
+// Steps a xorshift random number generator.
+//
+// Parameters:
+//      *seed   - unsigned int *, state of the generator, never 0
+//
+// Returns:
+//      The next random number.
+//
+unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// Turns a number into a scrambled 5 character carriage ID. 
+// Different numbers below ID_SPACE always give different IDs.
+//
+// Parameters:
+//      number      - int, number of the carriage
+//      id[ID_SIZE] - string, filled in with the ID
+//
+void number_to_id(int number, char id[ID_SIZE]) {
+    char *digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    // ID_SCRAMBLE shares no factors with ID_SPACE, so this is a shuffle.
+    unsigned int scrambled = ((unsigned long)number * ID_SCRAMBLE) % ID_SPACE;
+    int i = ID_SIZE - 2;
+    while (i >= 0) {
+        id[i] = digits[scrambled % ID_DIGITS];
+        scrambled /= ID_DIGITS;
+        i--;
+    }
+    id[ID_SIZE - 1] = '\0';
+}
+
+// Finds the time since start.
+//
+// Parameters:
+//      *start  - struct *, time read from CLOCK_MONOTONIC
+//
+// Returns:
+//      Nanoseconds since start.
+//
+long elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L 
+           + (now.tv_nsec - start->tv_nsec);
+}
+
+// Finds the histogram bucket of a latency. Latencies below 
+// HISTOGRAM_SUB_BUCKETS nanoseconds get a bucket each. Above that, each 
+// power of two is split into HISTOGRAM_SUB_BUCKETS buckets, so every 
+// bucket is within 1 / HISTOGRAM_SUB_BUCKETS of the latencies in it.
+//
+// Parameters:
+//      ns  - long, the latency in nanoseconds
+//
+// Returns:
+//      The bucket number.
+//
+int latency_bucket(long ns) {
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        return ns < 0 ? 0 : ns;
+    }
+    int power = 63 - __builtin_clzl(ns);
+    int sub_bucket = (ns >> (power - HISTOGRAM_SUB_BITS)) 
+                     & (HISTOGRAM_SUB_BUCKETS - 1);
+    int bucket = (power - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS 
+                 + sub_bucket;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    return bucket;
+}
+
+// Finds the smallest latency that goes in a histogram bucket.
+//
+// Parameters:
+//      bucket  - int, the bucket number
+//
+// Returns:
+//      The latency in nanoseconds.
+//
+long bucket_latency(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int power = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    long sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub_bucket) 
+           << (power - HISTOGRAM_SUB_BITS);
+}
+
+// Adds a command that was carried out to this thread's statistics.
+//
+// Parameters:
+//      code    - char, the command letter
+//      ns      - long, how long the command took in nanoseconds
+//
+void record_command(char code, long ns) {
+    char *found = strchr(STATS_CODES, code);
+    int slot = sizeof(STATS_CODES) - 1;
+    if (code != '\0' && found != NULL) {
+        slot = found - STATS_CODES;
+    }
+    struct command_stats *command = &stats.commands[slot];
+    command->count++;
+    command->total_ns += ns;
+    if (ns > command->max_ns) {
+        command->max_ns = ns;
+    }
+    command->histogram[latency_bucket(ns)]++;
+}
+
+// Finds the latency that a given share of a command's runs were within.
+//
+// Parameters:
+//      *command    - struct *, statistics of the command
+//      share       - double, between 0 and 1
+//
+// Returns:
+//      The smallest latency of the bucket the share is reached in.
+//
+long latency_at(struct command_stats *command, double share) {
+    long needed = (long)(share * command->count);
+    if (needed < 1) {
+        needed = 1;
+    }
+    long seen = 0;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1) {
+        seen += command->histogram[bucket];
+        if (seen >= needed) {
+            return bucket_latency(bucket);
+        }
+        bucket++;
+    }
+    return bucket_latency(bucket);
+}
+
+// Prints statistics as one JSON object. Only commands that were carried 
+// out are listed, each with its histogram as [latency, count] pairs for 
+// the buckets that were used.
+//
+// Parameters:
+//      *totals - struct *, statistics to print
+//
+void print_stats(struct stats *totals) {
+    print_out("{\"commands\": {");
+    int is_first = VALID;
+    int slot = 0;
+    while (slot < (int)sizeof(STATS_CODES)) {
+        struct command_stats *command = &totals->commands[slot];
+        if (command->count > 0) {
+            if (slot == sizeof(STATS_CODES) - 1) {
+                print_out("%s\"other\": {", is_first ? "" : ", ");
+            } else {
+                print_out("%s\"%c\": {", is_first ? "" : ", ", 
+                          STATS_CODES[slot]);
+            }
+            print_out("\"count\": %ld, \"total_ns\": %ld, \"max_ns\": %ld, "
+                      "\"p50_ns\": %ld, \"p99_ns\": %ld, \"histogram\": [", 
+                      command->count, command->total_ns, command->max_ns,
+                      latency_at(command, 0.5), latency_at(command, 0.99));
+            int is_first_bucket = VALID;
+            int bucket = 0;
+            while (bucket < HISTOGRAM_BUCKETS) {
+                if (command->histogram[bucket] > 0) {
+                    print_out("%s[%ld, %u]", is_first_bucket ? "" : ", ",
+                              bucket_latency(bucket), 
+                              command->histogram[bucket]);
+                    is_first_bucket = INVALID;
+                }
+                bucket++;
+            }
+            print_out("]}");
+            is_first = INVALID;
+        }
+        slot++;
+    }
+    print_out("}, \"index_probes\": %ld, \"tree_steps\": %ld, "
+              "\"allocations\": %ld, \"frees\": %ld}\n", 
+              totals->index_probes, totals->tree_steps, 
+              (long)memory.allocations, (long)memory.frees);
+}
+
+// Adds this thread's statistics to the totals for the whole program, 
+// and starts this thread's statistics again.
+//
+void merge_stats(void) {
+    pthread_mutex_lock(&stats_lock);
+    int slot = 0;
+    while (slot < (int)sizeof(STATS_CODES)) {
+        struct command_stats *from = &stats.commands[slot];
+        struct command_stats *to = &all_stats.commands[slot];
+        to->count += from->count;
+        to->total_ns += from->total_ns;
+        if (from->max_ns > to->max_ns) {
+            to->max_ns = from->max_ns;
+        }
+        int bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS) {
+            to->histogram[bucket] += from->histogram[bucket];
+            bucket++;
+        }
+        slot++;
+    }
+    all_stats.index_probes += stats.index_probes;
+    all_stats.tree_steps += stats.tree_steps;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Writes the statistics of the whole program to a file as JSON, once 
+// every thread is done.
+//
+// Parameters:
+//      *path   - string, file to write to, or NULL to write nothing
+//
+void dump_stats(char *path) {
+    if (path == NULL) {
+        return;
+    }
+    merge_stats();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot write statistics to '%s'\n", path);
+        return;
+    }
+    open_output(fd, VALID);
+    print_stats(&all_stats);
+    close_output();
+    close(fd);
+}
+
+// Builds a network of trains for the benchmarks through command_page. 
+// Carriage number k of each train has the ID number_to_id(k), a random type
+// and capacity, and is about half full.
+//
+// Parameters:
+//      *pool           - struct *, pool to allocate from
+//      *directory      - struct *, empty directory to list the trains in
+//      num_trains      - int, number of trains
+//      num_carriages   - int, number of carriages in each train
+//      *seed           - unsigned int *, random number generator state
+//
+// Returns:
+//      The first train, which is selected.
+//
+struct train *build_network(struct pool *pool, struct directory *directory,
+                            int num_trains, int num_carriages, 
+                            unsigned int *seed) {
+    struct train *selected = create_train(pool);
+    directory_insert(directory, 0, selected);
+    struct command command;
+    int train = 0;
+    while (train < num_trains) {
+        if (train > 0) {
+            command.code = NEW;
+            selected = command_page(selected, &command);
+            command.code = PREVIOUS;
+            selected = command_page(selected, &command);
+        }
+        int carriage = 0;
+        while (carriage < num_carriages) {
+            command.code = ADD;
+            number_to_id(carriage, command.id);
+            command.type = PASSENGER + next_random(seed) % FIRST_CLASS;
+            command.capacity = 1 + next_random(seed) % 999;
+            selected = command_page(selected, &command);
+
+            command.code = SEAT;
+            command.n = 1 + command.capacity / 2;
+            selected = command_page(selected, &command);
+            carriage++;
+        }
+        train++;
+    }
+    return head_train(selected);
+}
+
+// Finds how many times to run a command in its benchmark. 
+// Commands that use up trains or carriages can run fewer times.
+//
+// Parameters:
+//      code            - char, the command
+//      num_trains      - int, number of trains in the network
+//      num_carriages   - int, number of carriages in each train
+//
+// Returns:
+//      Number of times to run the command.
+//
+int bench_ops(char code, int num_trains, int num_carriages) {
+    int ops = BENCH_OPS;
+    if (code == REMOVE_TRAIN || code == MERGE) {
+        ops = num_trains - 1;
+    } 
+    else if ((code == REMOVE || code == SPLIT) && ops > num_carriages - 1) {
+        ops = num_carriages - 1;
+    }
+    return ops;
+}
+
+// Fills in random arguments for one run of a command in its benchmark.
+// Every ID given is in the selected train when the command runs.
+//
+// Parameters:
+//      *command        - struct *, command to fill in, its code already set
+//      op              - int, number of runs of the command so far
+//      num_carriages   - int, number of carriages each train started with
+//      *seed           - unsigned int *, random number generator state
+//
+void fill_bench_command(struct command *command, int op, int num_carriages,
+                        unsigned int *seed) {
+    char code = command->code;
+    int first = next_random(seed) % num_carriages;
+    int second = next_random(seed) % num_carriages;
+    if (first > second) {
+        int temp = first;
+        first = second;
+        second = temp;
+    }
+
+    if (code == ADD || code == INSERT) {
+        number_to_id(num_carriages + op, command->id);
+        command->type = PASSENGER + next_random(seed) % FIRST_CLASS;
+        command->capacity = 1 + next_random(seed) % 999;
+        command->n = next_random(seed) % (num_carriages + op);
+    }
+    else if (code == SEAT || code == DISEMBARK) {
+        number_to_id(first, command->id);
+        command->n = 1;
+    }
+    else if (code == COUNT || code == MOVE) {
+        number_to_id(first, command->id);
+        number_to_id(second, command->other_id);
+        command->n = 1;
+    }
+    else if (code == REMOVE) {
+        number_to_id(op, command->id);
+    }
+    else if (code == SPLIT) {
+        // splits off the last carriage left in the selected train
+        command->n = 1;
+        number_to_id(num_carriages - 1 - op, command->ids[0]);
+    }
+}
+
+// Times one command on a freshly built network and prints its row of 
+// the results. Building and freeing the network is not timed.
+//
+// Parameters:
+//      code            - char, the command
+//      num_trains      - int, number of trains in the network
+//      num_carriages   - int, number of carriages in each train
+//
+void bench_command(char code, int num_trains, int num_carriages) {
+    unsigned int seed = BENCH_SEED;
+    struct pool *pool = create_pool();
+    struct directory *directory = create_directory();
+    struct train *selected = build_network(pool, directory, num_trains, 
+                                           num_carriages, &seed);
+    int ops = bench_ops(code, num_trains, num_carriages);
+
+    struct command command;
+    command.code = code;
+    command.ids_size = 1;
+    command.ids = allocate(ID_SIZE);
+    command.loads = allocate(sizeof(int));
+
+    // the output of the commands themselves is thrown away
+    flush_output();
+    int stdout_fd = sink.fd;
+    sink.fd = open("/dev/null", O_WRONLY);
+
+    long time_taken = 0;
+    long allocations = memory.allocations;
+    int op = 0;
+    while (op < ops) {
+        fill_bench_command(&command, op, num_carriages, &seed);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        selected = command_page(selected, &command);
+        time_taken += elapsed_ns(&start);
+        op++;
+    }
+    allocations = memory.allocations - allocations;
+
+    flush_output();
+    close(sink.fd);
+    sink.fd = stdout_fd;
+    deallocate(command.ids);
+    deallocate(command.loads);
+    remove_all(selected);
+    free_directory(directory);
+    free_pool(pool);
+
+    print_out("%c  %10d  %12.1lf  %12.4lf\n", code, ops, 
+              (double)time_taken / ops, (double)allocations / ops);
+}
+
+// Times each command that changes or reports on the trains, 
+// on a network of num_trains trains of num_carriages carriages.
+//
+// Parameters:
+//      num_trains      - int, number of trains in the network
+//      num_carriages   - int, number of carriages in each train
+//
+void run_benchmarks(int num_trains, int num_carriages) {
+    char *codes = "aisdTcmPrRMS";
+    print_out("Benchmark: %d trains of %d carriages\n", num_trains, 
+              num_carriages);
+    print_out("command  ops         ns/op         allocs/op\n");
+    int i = 0;
+    while (codes[i] != '\0') {
+        bench_command(codes[i], num_trains, num_carriages);
+        i++;
+    }
+}
+
+// Picks a random number from 0 up to but not including limit.
+//
+// Parameters:
+//      *seed   - unsigned int *, random number generator state
+//      limit   - int, one more than the largest number to pick, at least 1
 //
 // Returns:
-//      The node to the current train in the train linked list. 
+//      The random number.
 //
-struct train *command_page(struct train *selected, char command) {
-    // prints help message
-    if (command == HELP) {
-        print_usage();
+int random_below(unsigned int *seed, int limit) {
+    return next_random(seed) % limit;
+}
+
+// Adds an empty train to the generator's train list.
+//
+// Parameters:
+//      *generator  - struct *, the generator
+//      position    - int, where in the train list the train goes
+//
+void generated_insert_train(struct generator *generator, int position) {
+    if (generator->num_trains == generator->trains_size) {
+        generator->trains_size *= 2;
+        generator->trains = reallocate(generator->trains, 
+            generator->trains_size * sizeof(struct generated_train));
     }
-    // adds carriage to the start
-    else if (command == ADD) {
-        int end_position = 0;
-        if (is_train_real(selected->carriages)) {
-            // sets the insertion point at the end of the linked list
-            end_position = train_length(selected->carriages);
-        }
-        selected->carriages = add_carriage(selected->carriages, 
-                                            end_position, command);
+    memmove(&generator->trains[position + 1], &generator->trains[position],
+            (generator->num_trains - position) 
+            * sizeof(struct generated_train));
+    generator->trains[position].carriages = NULL;
+    generator->trains[position].length = 0;
+    generator->trains[position].size = 0;
+    generator->num_trains++;
+}
+
+// Takes a train out of the generator's train list and frees it.
+//
+// Parameters:
+//      *generator  - struct *, the generator
+//      position    - int, where in the train list the train is
+//
+void generated_remove_train(struct generator *generator, int position) {
+    deallocate(generator->trains[position].carriages);
+    generator->num_trains--;
+    memmove(&generator->trains[position], &generator->trains[position + 1],
+            (generator->num_trains - position) 
+            * sizeof(struct generated_train));
+}
+
+// Adds a carriage to a generated train.
+//
+// Parameters:
+//      *train      - struct *, the train
+//      position    - int, where in the train the carriage goes
+//      carriage    - struct, the carriage
+//
+void generated_insert(struct generated_train *train, int position, 
+                      struct generated_carriage carriage) {
+    if (train->length == train->size) {
+        train->size = train->size * 2 + 1;
+        train->carriages = reallocate(train->carriages, 
+            train->size * sizeof(struct generated_carriage));
     }
-    // prints current train
-    else if (command == PRINT) {
-        print_train(selected->carriages);
+    memmove(&train->carriages[position + 1], &train->carriages[position],
+            (train->length - position) * sizeof(struct generated_carriage));
+    train->carriages[position] = carriage;
+    train->length++;
+}
+
+// Takes a carriage out of a generated train.
+//
+// Parameters:
+//      *train      - struct *, the train
+//      position    - int, where in the train the carriage is
+//
+void generated_remove(struct generated_train *train, int position) {
+    train->length--;
+    memmove(&train->carriages[position], &train->carriages[position + 1],
+            (train->length - position) * sizeof(struct generated_carriage));
+}
+
+// Prints an 'a' or 'i' command for a new carriage with a new ID.
+//
+// Parameters:
+//      *generator  - struct *, the generator
+//      code        - char, ADD or INSERT
+//
+void generate_add(struct generator *generator, char code) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    struct generated_carriage carriage;
+    carriage.number = generator->next_number;
+    carriage.capacity = 1 + random_below(&generator->seed, 999);
+    carriage.occupancy = 0;
+    generator->next_number++;
+
+    // spelt the way string_to_type reads them, one of each type in turn
+    char *types[] = {"passenger", "buffet", "restroom", "first_class"};
+    char *type = types[carriage.number % FIRST_CLASS];
+    char id[ID_SIZE];
+    number_to_id(carriage.number, id);
+    if (code == ADD) {
+        generated_insert(train, train->length, carriage);
+        print_out("a %s %s %d\n", id, type, carriage.capacity);
+    } else {
+        int position = random_below(&generator->seed, train->length + 1);
+        generated_insert(train, position, carriage);
+        print_out("i %d %s %s %d\n", position, id, type, carriage.capacity);
     }
-    // adds carriage anywhere in the linked list
-    else if (command == INSERT) {
-        // scans in position to insert carriage
-        int new_position;
-        scanf(" %d", &new_position);
-        selected->carriages = add_carriage(selected->carriages, 
-                                            new_position, command);
+}
+
+// Prints an 's' or 'd' command for a random carriage of the selected train.
+// The passengers always fit in or leave that carriage, so the generator 
+// knows where they are. A full carriage is emptied instead of seated, and 
+// an empty carriage is seated instead of emptied.
+//
+// Parameters:
+//      *generator  - struct *, the generator, with a non-empty selected train
+//      code        - char, SEAT or DISEMBARK
+//
+void generate_passengers(struct generator *generator, char code) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    struct generated_carriage *carriage = 
+        &train->carriages[random_below(&generator->seed, train->length)];
+    int free_seats = carriage->capacity - carriage->occupancy;
+    if (code == SEAT && free_seats == 0) {
+        code = DISEMBARK;
     }
-    // add passengers to the carriage
-    else if (command == SEAT) {
-        is_loading_valid(selected->carriages, command);
+    else if (code == DISEMBARK && carriage->occupancy == 0) {
+        code = SEAT;
     }
-    // remove passengers from the carriage
-    else if (command == DISEMBARK) {
-        is_loading_valid(selected->carriages, command);
+
+    int n;
+    if (code == SEAT) {
+        n = 1 + random_below(&generator->seed, free_seats);
+        carriage->occupancy += n;
+    } else {
+        n = 1 + random_below(&generator->seed, carriage->occupancy);
+        carriage->occupancy -= n;
     }
-    // counts the total occupants and spare seats in the train.
-    else if (command == TOTAL) {
-        // checks to see if there are carriages
-        if (is_train_real(selected->carriages)) {
-            // finds start and end IDs of the train
-            struct ends train_ends = find_edges(selected->carriages);
+    char id[ID_SIZE];
+    number_to_id(carriage->number, id);
+    print_out("%c %s %d\n", code, id, n);
+}
 
-            count_passengers(selected->carriages, train_ends.start, 
-                                train_ends.end, command);
-        
-        } else {
-            // edge case where there are no carriages
-            printf("Total occupancy: 0\n");
-            printf("Unoccupied capacity: 0\n");             
+// Prints an 'm' command between two random carriages of the selected train,
+// moving no more passengers than fit in the destination carriage. 
+// Seats passengers instead if there is no one to move.
+//
+// Parameters:
+//      *generator  - struct *, the generator, with a non-empty selected train
+//
+void generate_move(struct generator *generator) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    struct generated_carriage *source = 
+        &train->carriages[random_below(&generator->seed, train->length)];
+    struct generated_carriage *destination = 
+        &train->carriages[random_below(&generator->seed, train->length)];
+    int limit = source->occupancy;
+    if (destination->capacity - destination->occupancy < limit) {
+        limit = destination->capacity - destination->occupancy;
+    }
+    if (source == destination || limit == 0) {
+        generate_passengers(generator, SEAT);
+        return;
+    }
+
+    int n = 1 + random_below(&generator->seed, limit);
+    source->occupancy -= n;
+    destination->occupancy += n;
+    char source_id[ID_SIZE];
+    char destination_id[ID_SIZE];
+    number_to_id(source->number, source_id);
+    number_to_id(destination->number, destination_id);
+    print_out("m %s %s %d\n", source_id, destination_id, n);
+}
+
+// Prints a 'c' command over a random range of the selected train.
+//
+// Parameters:
+//      *generator  - struct *, the generator, with a non-empty selected train
+//
+void generate_count(struct generator *generator) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    int start = random_below(&generator->seed, train->length);
+    int end = random_below(&generator->seed, train->length);
+    if (start > end) {
+        int temp = start;
+        start = end;
+        end = temp;
+    }
+    char start_id[ID_SIZE];
+    char end_id[ID_SIZE];
+    number_to_id(train->carriages[start].number, start_id);
+    number_to_id(train->carriages[end].number, end_id);
+    print_out("c %s %s\n", start_id, end_id);
+}
+
+// Prints an 'S' command at a few distinct carriages of the selected train,
+// then splits the generator's trains the same way split_trains does: 
+// each ID starts a new train right after the part of the selected train 
+// it is in.
+//
+// Parameters:
+//      *generator  - struct *, the generator, with a non-empty selected train
+//
+void generate_split(struct generator *generator) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    int num_splits = 1 + random_below(&generator->seed, GENERATE_MAX_SPLITS);
+    if (num_splits > train->length) {
+        num_splits = train->length;
+    }
+    int numbers[GENERATE_MAX_SPLITS];
+    int split = 0;
+    while (split < num_splits) {
+        // picks again if the carriage was already picked
+        int position = random_below(&generator->seed, train->length);
+        int number = train->carriages[position].number;
+        int i = 0;
+        while (i < split && numbers[i] != number) {
+            i++;
+        }
+        if (i == split) {
+            numbers[split] = number;
+            split++;
         }
     }
-    // counts the total occupants and spare seats in a section of the train
-    else if (command == COUNT) {
-        // scans in start and end carriage ids.
-        char start[ID_SIZE];
-        scan_id(start);
-        char end[ID_SIZE];
-        scan_id(end);
 
-        count_passengers(selected->carriages, start, end, command);
+    print_out("S %d", num_splits);
+    split = 0;
+    while (split < num_splits) {
+        char id[ID_SIZE];
+        number_to_id(numbers[split], id);
+        print_out(" %s", id);
+        split++;
     }
-    // moves passengers from one train to the next
-    else if (command == MOVE) {
-        is_move_valid(selected->carriages, command);
+    print_out("\n");
+
+    // the parts of the selected train stay next to each other in the list
+    split = 0;
+    while (split < num_splits) {
+        int part = generator->selected;
+        int position = -1;
+        while (position == -1) {
+            struct generated_train *current = &generator->trains[part];
+            int i = 0;
+            while (i < current->length 
+                   && current->carriages[i].number != numbers[split]) {
+                i++;
+            }
+            if (i < current->length) {
+                position = i;
+            } else {
+                part++;
+            }
+        }
+        generated_insert_train(generator, part + 1);
+        struct generated_train *front = &generator->trains[part];
+        int j = position;
+        while (j < front->length) {
+            generated_insert(&generator->trains[part + 1], j - position, 
+                             front->carriages[j]);
+            j++;
+        }
+        front->length = position;
+        split++;
     }
-    // creates a new train
-    else if (command == NEW) {
-        struct train *new = create_train();
+}
 
-        // connects new node to old previous node
-        if (selected->previous != NULL) {
-            selected->previous->next = new;
-            new->previous = selected->previous;
-        } else {
-            new->previous = NULL;
+// Prints an 'M' command and joins the generator's selected train with the
+// next one. Every generated ID is new, so there are never duplicates.
+//
+// Parameters:
+//      *generator  - struct *, the generator, with a train after the selected
+//
+void generate_merge(struct generator *generator) {
+    struct generated_train *back = &generator->trains[generator->selected + 1];
+    int i = 0;
+    while (i < back->length) {
+        struct generated_train *front = 
+            &generator->trains[generator->selected];
+        generated_insert(front, front->length, back->carriages[i]);
+        i++;
+    }
+    generated_remove_train(generator, generator->selected + 1);
+    print_out("M\n");
+}
+
+// Prints a command that changes the train list or the selected train, and
+// follows it in the generator.
+//
+// Parameters:
+//      *generator  - struct *, the generator
+//      code        - char, NEW, NEXT, PREVIOUS or REMOVE_TRAIN
+//
+void generate_navigation(struct generator *generator, char code) {
+    if (code == NEW) {
+        // the new train goes before the selected train
+        generated_insert_train(generator, generator->selected);
+        generator->selected++;
+    }
+    else if (code == NEXT) {
+        if (generator->selected + 1 < generator->num_trains) {
+            generator->selected++;
         }
-        // connects new node with currently selected node
-        selected->previous = new;
-        new->next = selected;
     }
-    // cycles to the proceeding train
-    else if (command == NEXT) {
-        if (selected->next != NULL) {
-            selected = selected->next;
+    else if (code == PREVIOUS) {
+        if (generator->selected > 0) {
+            generator->selected--;
+        }
+    } else {
+        // the previous train is selected next if there is one, and an empty
+        // train replaces the last one.
+        generated_remove_train(generator, generator->selected);
+        if (generator->selected > 0) {
+            generator->selected--;
+        } 
+        else if (generator->num_trains == 0) {
+            generated_insert_train(generator, 0);
         }
     }
-    // cycles to the preceeding train
-    else if (command == PREVIOUS) {
-        if (selected->previous != NULL) {
-            selected = selected->previous;
+    print_out("%c\n", code);
+}
+
+// Prints one command of the script. Most commands move passengers around,
+// the trains are polled with 'P' and shunted with 'S' and 'M' periodically,
+// and carriages and trains are added and removed now and then.
+//
+// Parameters:
+//      *generator      - struct *, the generator
+//      command_number  - int, number of commands printed so far
+//
+void generate_command(struct generator *generator, int command_number) {
+    struct generated_train *train = &generator->trains[generator->selected];
+    int is_last = generator->selected + 1 == generator->num_trains;
+    int pick = random_below(&generator->seed, 100);
+
+    if (command_number % GENERATE_POLL_PERIOD == GENERATE_POLL_PERIOD - 1) {
+        print_out("P\n");
+    }
+    else if (command_number % GENERATE_SHUNT_PERIOD 
+             == GENERATE_SHUNT_PERIOD - 1) {
+        // splits and merges take turns, keeping the number of trains steady
+        if (generator->is_next_split && train->length > 1) {
+            generate_split(generator);
+        } 
+        else if (!is_last) {
+            generate_merge(generator);
+        } else {
+            generate_navigation(generator, PREVIOUS);
         }
+        generator->is_next_split = !generator->is_next_split;
     }
-    // prints all the trains
-    else if (command == PRINT_ALL) {
-        print_all(selected);
+    // an empty train only gets carriages added
+    else if (train->length == 0 || pick < 10) {
+        generate_add(generator, pick % 4 == 0 ? INSERT : ADD);
     }
-    // removes a carriage from the selected train
-    else if (command == REMOVE) {
+    else if (pick < 35) {
+        generate_passengers(generator, SEAT);
+    }
+    else if (pick < 55) {
+        generate_passengers(generator, DISEMBARK);
+    }
+    else if (pick < 75) {
+        generate_move(generator);
+    }
+    else if (pick < 80) {
+        generate_count(generator);
+    }
+    else if (pick < 83) {
+        print_out("T\n");
+    }
+    else if (pick < 87) {
         char id[ID_SIZE];
-        scan_id(id);
-        selected->carriages = remove_carriage(selected->carriages, id);
+        int position = random_below(&generator->seed, train->length);
+        number_to_id(train->carriages[position].number, id);
+        generated_remove(train, position);
+        print_out("r %s\n", id);
     }
-    // removes the entire train
-    else if (command == REMOVE_TRAIN) {
-        struct train *temp = selected;
-        // arranges the trains next/previous links and updates selected
-        selected = arrange_trains(selected);
-        // removes the previouslly selected train.
-        remove_train(temp);
+    else if (pick < 89 && generator->num_trains < GENERATE_MAX_TRAINS) {
+        generate_navigation(generator, NEW);
     }
-    // Merges current and next train together
-    else if (command == MERGE) {
-        if (selected->next != NULL) {
-            merge_trains(selected);
-        }
+    else if (pick < 94) {
+        generate_navigation(generator, NEXT);
     }
-    // Splits trains into parts at the given carriage ID's.
-    else if (command == SPLIT) {
-        split_trains(selected);
+    else if (pick < 99) {
+        generate_navigation(generator, PREVIOUS);
+    }
+    else if (generator->num_trains > 1) {
+        generate_navigation(generator, REMOVE_TRAIN);
+    } else {
+        print_out("p\n");
     }
-    return selected;
 }
 
-// Merges the double carriage ID's into the first train and deletes it 
-// from the 2nd train
+// Prints a script of commands that all refer to carriages that exist.
+// The same seed and count always give the same script.
 //
-// Parameters: 
-//      *head           - struct *, start of the carriages of the train to keep
-//      *next_carriage  - struct *, start of the carriages of the train to 
-//                                  delete.
-//
-// Returns:
-//      The head of the train to delete. 
+// Parameters:
+//      seed    - unsigned int, seed of the script
+//      count   - int, number of commands in the script
 //
-struct carriage *merge_dupes(struct carriage *head, 
-                             struct carriage *next_carriage) {
-    struct carriage *current = next_carriage;
-    while (current != NULL) {
-        if (is_id_in_train(current->carriage_id, head)) {
-            // find duplicate and add passengers to the current train
-            struct carriage *to_fix = find_id(head, current->carriage_id);
-            to_fix->capacity += current->capacity;
-            to_fix->occupancy += current->occupancy;
+void run_generator(unsigned int seed, int count) {
+    struct generator generator;
+    generator.trains_size = 1;
+    generator.trains = allocate(sizeof(struct generated_train));
+    generator.num_trains = 0;
+    generator.selected = 0;
+    generator.next_number = 0;
+    generator.is_next_split = VALID;
+    // xorshift never leaves a zero state, so the seed is scrambled first
+    generator.seed = (seed * ID_SCRAMBLE) ^ BENCH_SEED;
+    if (generator.seed == 0) {
+        generator.seed = BENCH_SEED;
+    }
+    generated_insert_train(&generator, 0);
 
-            // remove empty carriage from next train.
-            struct carriage *temp = current;
-            current = current->next;
-            next_carriage = remove_carriage(next_carriage, temp->carriage_id);
-        } else {
-            current = current->next;
-        }
+    int command_number = 0;
+    while (command_number < count) {
+        generate_command(&generator, command_number);
+        command_number++;
+    }
+
+    while (generator.num_trains > 0) {
+        generated_remove_train(&generator, 0);
     }
-    // returns head of next train's 
-    return next_carriage;
+    deallocate(generator.trains);
 }
 
-// Merges 2 trains (carriages linked lists) into one.
-// Then deletes the second train node. 
+// Runs a stream of commands from each file as its own shard, all at once 
+// on their own threads. Every shard hosts its own networks, so shards 
+// share nothing but the output.
 //
-// Parameters: 
-//      *selected   - struct *, selected node along the train linked list 
+// Parameters:
+//      *paths[]    - string array, file of commands for each shard
+//      num_shards  - int, number of shards
+//      is_quiet    - int, VALID if confirmations and prompts are left out
 //
-void merge_trains(struct train *selected) {
-    struct carriage *current = selected->carriages;
-    struct train *next_train = selected->next;
-    struct carriage *next_carriage = next_train->carriages;
-
-    // loop to end of current train if exists
-    if (is_train_real(current)) {
-        while (current->next != NULL) {
-            current = current->next;
+// Returns:
+//      VALID   - if every shard's commands were carried out
+//      INVALID - if a file couldn't be read, after printing an error
+//
+int run_shards(char *paths[], int num_shards, int is_quiet) {
+    struct shard *shards = allocate(num_shards * sizeof(struct shard));
+    int number = 0;
+    while (number < num_shards) {
+        if (!open_batch(&shards[number].input, paths[number])) {
+            fprintf(stderr, "ERROR: Cannot read commands from '%s'\n", 
+                    paths[number]);
+            while (number > 0) {
+                number--;
+                close_input(&shards[number].input);
+            }
+            deallocate(shards);
+            return INVALID;
         }
+        shards[number].number = number;
+        shards[number].is_quiet = is_quiet;
+        number++;
+    }
 
-        // connect 2nd train to first if both exist
-        if (is_train_real(next_carriage)) {
-            // removes duplicates from 2nd train first. 
-            current->next = merge_dupes(selected->carriages, next_carriage);
-        }
+    open_output(STDOUT_FILENO, is_quiet);
+    print_out("Welcome to Carriage Simulator\n");
+    print_out("All aboard!\n");
+    flush_output();
 
-    } else if (is_train_real(next_carriage)) {
-        // if no carriages in first, but there is in the 2nd, 
-        // moves the carriages to the first train instead.
-        selected->carriages = next_carriage;
+    // a shard that can't get its own thread is run on this one
+    number = 0;
+    while (number < num_shards) {
+        shards[number].is_started = validity(pthread_create(
+            &shards[number].thread, NULL, run_shard, &shards[number]) == 0);
+        if (!shards[number].is_started) {
+            run_shard(&shards[number]);
+        }
+        number++;
     }
-
-    // remove 2nd train from linked list
-    selected->next = next_train->next;
-    if (next_train->next != NULL) {
-        next_train->next->previous = selected;
+    number = 0;
+    while (number < num_shards) {
+        if (shards[number].is_started) {
+            pthread_join(shards[number].thread, NULL);
+        }
+        close_input(&shards[number].input);
+        number++;
     }
-    free(next_train);
+
+    deallocate(shards);
+    print_out("\nGoodbye\n");
+    close_output();
+    return VALID;
 }
 
-// If the inputs are valid, splits the train into multiple parts.
-// Splits the selected train by the inputed carriage IDs by creating new trains
-// and moving carriages into the new trains from the old train. 
+// Carries out every command in a shard's input on the shard's own 
+// networks. The shard's output is buffered on its own and written out in 
+// whole blocks.
 //
-// Parameters: 
-//      *start  - struct *, selected node along the train linked list 
+// Parameters:
+//      *shard  - struct shard *, the shard to run
+//
+// Returns:
+//      NULL, as the shard's networks are freed when it is done.
 //
-void split_trains(struct train *start) {
-    int num_splits;
-    scanf(" %d", &num_splits);
+void *run_shard(void *shard) {
+    struct shard *at = shard;
+    open_output(STDOUT_FILENO, at->is_quiet);
+    print_out("Shard #%d\n", at->number);
 
-    if (!is_pos(num_splits)) {
-        printf("ERROR: n must be a positive integer\n");
-    } else {
-        printf("Enter ids: \n");
+    struct network_list *networks = create_network_list();
+    struct command command;
+    command.ids = NULL;
+    command.loads = NULL;
+    command.ids_size = 0;
+    print_prompt("Enter command: ");
+    while (scan_command(&at->input, &command)) {
+        run_command(networks, &command);
+        print_prompt("Enter command: ");
+    }
 
-        // Number of trains to check.
-        // Note: after train is split at least once, must check multiple trains.
-        int check_trains = 1;
+    free_network_list(networks);
+    deallocate(command.ids);
+    deallocate(command.loads);
+    close_output();
+    merge_stats();
+    return NULL;
+}
 
-        int split = 0;
-        // current train to check into
-        struct train *selected = start;
-        // repeats the desired number of splits 
-        while (split < num_splits) {
-            // scann in ID to split at.
-            char id[ID_SIZE];
-            scan_id(id);
-        
-            int i = 0;
-            enum condition is_id_found = INVALID;
-            while (is_id_found == INVALID && i < check_trains) {
-                // splits the train between a single ID
-                // If splits, ends the loop, otherwise keeps searching. 
-                is_id_found = split_train_once(selected, id, &check_trains);
-
-                // checks into next train (which is part of original train)
-                selected = selected->next;
-                i++;
+// Runs a stream of commands from each file at its own control desk, all at
+// once on their own threads. Desk n starts at train n. Commands on a desk's 
+// train only lock that train, and commands that change the list of trains 
+// lock the whole directory.
+//
+// Parameters:
+//      *paths[]    - string array, file of commands for each desk
+//      num_desks   - int, number of desks
+//      is_quiet    - int, VALID if confirmations and prompts are left out
+//
+// Returns:
+//      VALID   - if every desk's commands were carried out
+//      INVALID - if a file couldn't be read, after printing an error
+//
+int run_desks(char *paths[], int num_desks, int is_quiet) {
+    struct desk *desks = allocate(num_desks * sizeof(struct desk));
+    int number = 0;
+    while (number < num_desks) {
+        if (!open_batch(&desks[number].input, paths[number])) {
+            fprintf(stderr, "ERROR: Cannot read commands from '%s'\n", 
+                    paths[number]);
+            while (number > 0) {
+                number--;
+                close_input(&desks[number].input);
             }
+            deallocate(desks);
+            return INVALID;
+        }
+        number++;
+    }
 
-            // Prints error message if ID is not found in the select train(s). 
-            if (!is_id_found) {
-                printf("No carriage exists with id: '%s'. Skipping\n", id);
-            } 
+    open_output(STDOUT_FILENO, is_quiet);
+    print_out("Welcome to Carriage Simulator\n");
+    print_out("All aboard!\n");
+    flush_output();
 
-            // reset to start of initial train and repeat for next ID. 
-            selected = start;
-            split++;
-        }
+    struct pool *pool = create_pool();
+    pool->is_shared = VALID;
+    struct directory *directory = create_directory();
+    number = 0;
+    while (number < num_desks) {
+        struct train *train = create_train(pool);
+        directory_insert(directory, number, train);
+        train->num_desks = 1;
+        desks[number].number = number;
+        desks[number].selected = train;
+        desks[number].is_quiet = is_quiet;
+        number++;
+    }
+    directory->num_desks = num_desks;
 
+    // a desk that can't get its own thread is run on this one
+    number = 0;
+    while (number < num_desks) {
+        desks[number].is_started = validity(pthread_create(
+            &desks[number].thread, NULL, run_desk, &desks[number]) == 0);
+        if (!desks[number].is_started) {
+            run_desk(&desks[number]);
+        }
+        number++;
+    }
+    number = 0;
+    while (number < num_desks) {
+        if (desks[number].is_started) {
+            pthread_join(desks[number].thread, NULL);
+        }
+        close_input(&desks[number].input);
+        number++;
     }
+
+    remove_all(directory->trains[0]);
+    free_directory(directory);
+    free_pool(pool);
+    deallocate(desks);
+    print_out("\nGoodbye\n");
+    close_output();
+    return VALID;
 }
 
-// Checks if the ID is in the train. If yes, performs the split.
-// Creates a new train and moves the carriages into the new train.
+// Carries out every command in a desk's input. The desk's output is 
+// buffered on its own and written out in whole blocks.
 //
-// Parameters: 
-//      *selected   - struct *, selected node along the train linked list 
+// Parameters:
+//      *desk   - struct desk *, the desk to run
 //
 // Returns:
-//      VALID   - If the carriages split did occur 
-//      INVALID - If the carriages split did not occur
-// 
-int split_train_once(struct train *selected, char id[ID_SIZE], 
-                     int *check_trains) {
-    struct carriage *current = selected->carriages;
-    // find where next carriage is where new train should begin.
-    if (is_train_real(current) && is_id_in_train(id, current)) {            
-        // create new train
-        struct train *new = create_train();
-        // connects new train to next train
-        if (selected->next != NULL) {
-            selected->next->previous = new;
-            new->next = selected->next;
-        } else {
-            new->next = NULL;
-        }
-        // connects new node with currently selected node
-        selected->next = new;
-        new->previous = selected;
+//      NULL, as the desk's work is all in the network.
+//
+void *run_desk(void *desk) {
+    struct desk *at = desk;
+    open_output(STDOUT_FILENO, at->is_quiet);
+    print_out("Desk #%d\n", at->number);
 
-        // find where split should occur
-        int end_train = find_id_index(current, id);
+    struct command command;
+    command.ids = NULL;
+    command.loads = NULL;
+    command.ids_size = 0;
+    print_prompt("Enter command: ");
+    while (scan_command(&at->input, &command)) {
+        desk_command(at, &command);
+        print_prompt("Enter command: ");
+    }
 
-        // Edge case if splitting at start of carriage linked list
-        if (end_train == INVALID) {
-            new->carriages = current;
-            selected->carriages = NULL;
-        } else {
-            int j = 0;
-            // loops to the end of the front half of the split train
-            while (j < end_train - 1) {
-                current = current->next;
-                j++;
-            }
+    merge_stats();
+    // the desk leaves its train and the network
+    struct directory *directory = at->selected->directory;
+    pthread_rwlock_wrlock(&directory->lock);
+    at->selected->num_desks--;
+    directory->num_desks--;
+    pthread_rwlock_unlock(&directory->lock);
 
-            // Removes split from train and attaches to new train.
-            new->carriages = current->next;
-            current->next = NULL;
-        }
+    deallocate(command.ids);
+    deallocate(command.loads);
+    close_output();
+    return NULL;
+}
 
-        // since new train created, need to check more trains next time. 
-        (*check_trains)++; 
+// Carries out one command at a desk, holding the locks it needs. 
+// A command that would remove a train another desk is working on, or 
+// replace every train while other desks are working, isn't carried out.
+//
+// Parameters:
+//      *desk       - struct *, desk the command was given at
+//      *command    - struct *, command given by the user
+//
+void desk_command(struct desk *desk, struct command *command) {
+    struct train *selected = desk->selected;
+    struct directory *directory = selected->directory;
+    if (!is_structural(command->code)) {
+        pthread_rwlock_rdlock(&directory->lock);
+        pthread_mutex_lock(&selected->lock);
+        command_page(selected, command);
+        pthread_mutex_unlock(&selected->lock);
+        pthread_rwlock_unlock(&directory->lock);
+        return;
+    }
 
-        // we found the ID, so we exit the loop and move to the next ID.
-        return VALID;
+    pthread_rwlock_wrlock(&directory->lock);
+    struct train *next = train_at(directory, selected->number + 1);
+    if ((command->code == REMOVE_TRAIN && selected->num_desks > 1)
+        || (command->code == MERGE && next != NULL && next->num_desks > 0)) {
+        print_out("ERROR: Train is in use at another desk\n");
+    } 
+    else if (command->code == LOAD && directory->num_desks > 1) {
+        print_out("ERROR: Network is in use at another desk\n");
     } else {
-        return INVALID;
+        desk->selected = command_page(selected, command);
+        if (desk->selected != selected) {
+            // a removed train, or every train before a load, is gone
+            if (command->code != REMOVE_TRAIN && command->code != LOAD) {
+                selected->num_desks--;
+            }
+            desk->selected->num_desks++;
+        }
     }
+    pthread_rwlock_unlock(&directory->lock);
+}
+
+// Checks if a command changes the list of trains, or needs it to stay the
+// same while the command looks through it.
+//
+// Parameters:
+//      code    - char, the command letter
+//
+// Returns:
+//      VALID   - if the command needs the whole directory to itself
+//      INVALID - if it only needs the selected train
+//
+int is_structural(char code) {
+    return validity(code == NEW || code == REMOVE_TRAIN || code == MERGE 
+                    || code == SPLIT || code == NEXT || code == PREVIOUS 
+                    || code == SELECT || code == PRINT_ALL 
+                    || code == PRINT_TRAINS || code == SAVE || code == LOAD);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1243,13 +5988,15 @@ int split_train_once(struct train *selected, char id[ID_SIZE],
 // displaying the different commands and their arguments.
 //
 void print_usage(void) {
-    printf(
+    print_out("%s",
         "=====================[ Carriage Simulator ]=====================\n"
         "      ===============[     Usage Info     ]===============      \n"
         "  a [carriage_id] [type] [capacity]                             \n"
         "    Add a carriage to the train                                 \n"
         "  p                                                             \n"
         "    Print out all of the carriages in the train                 \n"
+        "  l [start] [end]                                               \n"
+        "    Print out the carriages from position `start` up to `end`   \n"
         "  i [n] [carriage_id] [type] [capacity]                         \n"
         "    Insert a carriage into the train at position `n`            \n"
         "                                                                \n"
@@ -1258,6 +6005,10 @@ void print_usage(void) {
         "    `carriage_id`                                               \n"
         "  d [carriage_id] [n]                                           \n"
         "    Remove `n` passengers from carriage `carriage_id`           \n"
+        "  e [k] [carriage_id] [n] ...                                   \n"
+        "    Seat passengers as `k` `s` commands, one after another      \n"
+        "  u [k] [carriage_id] [n] ...                                   \n"
+        "    Remove passengers as `k` `d` commands, one after another    \n"
         "  T                                                             \n"
         "    Display the total number of passengers and empty seats on   \n"
         "    the train                                                   \n"
@@ -1279,8 +6030,12 @@ void print_usage(void) {
         "    Select the next train in the train list.                    \n"
         "  <                                                             \n"
         "    Select the previous train in the train list.                \n"
+        "  g [n]                                                         \n"
+        "    Select train `n` in the train list.                         \n"
         "  P                                                             \n"
         "    Display the train list.                                     \n"
+        "  L [k] [n]                                                     \n"
+        "    Display `n` trains of the train list, starting at train `k`.\n"
         "  r [carriage_id]                                               \n"
         "    Remove carriage `carriage_id` from the selected train.      \n"
         "  R                                                             \n"
@@ -1293,6 +6048,19 @@ void print_usage(void) {
         "  O                                                             \n"
         "    Rearrange passengers on the selected train to optimise      \n"
         "    happiness.                                                  \n"
+        "  w [file]                                                      \n"
+        "    Save every train to `file`.                                 \n"
+        "  o [file]                                                      \n"
+        "    Replace every train with the ones saved in `file`.          \n"
+        "  n                                                             \n"
+        "    Create a new network with one empty train, and switch to it.\n"
+        "  j [n]                                                         \n"
+        "    Switch to network `n`.                                      \n"
+        "  x                                                             \n"
+        "    Drop the current network.                                   \n"
+        "  z                                                             \n"
+        "    Display how often each command ran and how long it took, as \n"
+        "    JSON.                                                       \n"
         "  ?                                                             \n"
         "    Show help                                                   \n"
         "================================================================\n"
@@ -1304,35 +6072,39 @@ void print_usage(void) {
 // '\0' at the end.
 //
 // Parameters:
+//      input     - the input to scan from.
 //      id_buffer - a char array of length ID_SIZE, which will be used
 //                  to store the id.
 // 
 // Usage: 
 // ```
 //      char id[ID_SIZE];
-//      scan_id(id);
+//      scan_id(input, id);
 // ```
-void scan_id(char id_buffer[ID_SIZE]) {
-    scan_token(id_buffer, ID_SIZE);
+void scan_id(struct input *input, char id_buffer[ID_SIZE]) {
+    scan_token(input, id_buffer, ID_SIZE);
 }
 
 
 // Scans a string and converts it to a carriage_type.
 //
+// Parameters:
+//      input     - the input to scan from.
+//
 // Returns:
 //      The corresponding carriage_type, if the string was valid,
 //      Otherwise, returns INVALID_TYPE.
 // 
 // Usage: 
 // ```
-//      enum carriage_type type = scan_type();
+//      enum carriage_type type = scan_type(input);
 // ```
 //
-enum carriage_type scan_type(void) {
+enum carriage_type scan_type(struct input *input) {
     // This 20 should be #defined, but we've kept it like this to
     // avoid adding additional constants to your code.
-    char type[20];
-    scan_token(type, 20);
+    char type[20] = "";
+    scan_token(input, type, 20);
     return string_to_type(type);
 }
 
@@ -1348,18 +6120,20 @@ void print_carriage(struct carriage *carriage) {
     char *id = carriage->carriage_id;
     char *type = type_to_string(carriage->type);
 
-    printf(" ---------\\/--------- \n");
-
-    int padding = line_length - strlen(id);
-    printf("|%*s%s%*s|\n", padding / 2, "", id, (padding + 1) / 2, "");
+    int id_padding = line_length - strlen(id);
+    int type_padding = line_length - 2 - strlen(type);
 
-    padding = line_length - 2 - strlen(type);
-    printf("|%*s(%s)%*s|\n", padding / 2, "", type, (padding + 1) / 2, "");
-
-    printf("| Occupancy: %3d/%-3d |\n", 
-            carriage->occupancy, 
-            carriage->capacity);
-    printf(" ---------||--------- \n");
+    // the whole carriage is formatted at once
+    print_out(
+        " ---------\\/--------- \n"
+        "|%*s%s%*s|\n"
+        "|%*s(%s)%*s|\n"
+        "| Occupancy: %3d/%-3d |\n"
+        " ---------||--------- \n",
+        id_padding / 2, "", id, (id_padding + 1) / 2, "",
+        type_padding / 2, "", type, (type_padding + 1) / 2, "",
+        carriage->occupancy, carriage->capacity
+    );
 }
 
 
@@ -1381,16 +6155,45 @@ void print_train_summary(
     int occupancy,
     int num_carriages
 ) {
+    char text[SUMMARY_SIZE];
+    int length = format_train_summary(text, is_selected, n, capacity, 
+                                      occupancy, num_carriages);
+    write_out(text, length);
+}
+
+// Formats the information printed about a given train by 
+// print_train_summary, so it can also be formatted off the main thread.
+//
+// Parameters:
+//      text        - A char array of length SUMMARY_SIZE to format into.
+//      is_selected, n, capacity, occupancy and num_carriages are the same
+//      as for print_train_summary.
+//
+// Returns:
+//      The number of characters formatted.
+//
+int format_train_summary(
+    char text[SUMMARY_SIZE],
+    int is_selected, 
+    int n, 
+    int capacity, 
+    int occupancy,
+    int num_carriages
+) {
+    char *marker = "    ";
     if (is_selected) {
-        printf("--->Train #%d\n", n);
-    } else  {
-        printf("    Train #%d\n", n);
+        marker = "--->";
     }
 
-    printf("        Carriages: %3d\n", num_carriages);
-    printf("        Capacity : %3d/%-3d\n", occupancy, capacity);
-    printf("    ----------------------\n");
-
+    // the whole summary is formatted at once
+    return snprintf(
+        text, SUMMARY_SIZE,
+        "%sTrain #%d\n"
+        "        Carriages: %3d\n"
+        "        Capacity : %3d/%-3d\n"
+        "    ----------------------\n",
+        marker, n, num_carriages, occupancy, capacity
+    );
 }
 
 
@@ -1469,25 +6272,30 @@ char *type_to_string(enum carriage_type type) {
     return "INVALID";
 }
 
-int scan_token(char *buffer, int buffer_size) {
+int scan_token(struct input *input, char *buffer, int buffer_size) {
     if (buffer_size == 0) {
         return 0;
     }
 
-    char c;
+    int c = 0;
     int i = 0;
     int num_scanned = 0;
 
     // consume all leading whitespace
-    scanf(" ");
+    skip_space(input);
 
-    // Scan in characters until whitespace
+    // Scan in characters until whitespace, which is consumed too
     while (i < buffer_size - 1
-        && (num_scanned = scanf("%c", &c)) == 1 
+        && (c = next_char(input)) != EOF
         && !isspace(c)) {
 
         buffer[i++] = c;
     }
+    if (c == EOF) {
+        num_scanned = EOF;
+    } else if (i > 0 || isspace(c)) {
+        num_scanned = 1;
+    }
 
     if (i > 0) {
         buffer[i] = '\0';
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs every test case against the simulator, and reports the ones whose 
+# output differs from what was expected.
+#
+# Each case is a directory of sessions 1.in, 2.in, ..., run one after 
+# another in batch mode, each from its own new directory. An args file
+# adds options to every session, with JOURNAL standing for a journal shared
+# by the sessions. The output of all the sessions together must match 
+# expected.out, with the times 'O' reports written as "in N ms".
+#
+# Usage: tests/run_tests.sh ./simulator
+
+simulator=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+tests=$(cd "$(dirname "$0")" && pwd)
+failed=0
+
+for case_dir in "$tests"/*/; do
+    name=$(basename "$case_dir")
+    work=$(mktemp -d)
+    args=""
+    if [ -f "$case_dir/args" ]; then
+        args=$(sed "s|JOURNAL|$work/journal.bin|g" "$case_dir/args")
+    fi
+    session=1
+    while [ -f "$case_dir/$session.in" ]; do
+        mkdir "$work/$session"
+        (cd "$work/$session" && 
+         "$simulator" --batch "$case_dir/$session.in" $args 2>&1)
+        session=$((session + 1))
+    done | sed 's/ in [0-9.]* ms$/ in N ms/' > "$work/actual.out"
+
+    if cmp -s "$work/actual.out" "$case_dir/expected.out"; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        diff "$case_dir/expected.out" "$work/actual.out"
+        failed=$((failed + 1))
+    fi
+    rm -rf "$work"
+done
+
+if [ "$failed" -gt 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi